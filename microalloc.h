@@ -0,0 +1,165 @@
+/*
+ * microalloc.h - extensions to the standard allocation interface.
+ * malloc, free, calloc and realloc are replaced directly; the functions
+ * declared here are only available when microalloc is linked in or
+ * preloaded.
+ */
+#ifndef MICROALLOC_H
+#define MICROALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* builds with -DMA_NO_SBRK leave the process's own allocator in place,
+ * and provide these instead of the standard functions */
+#ifdef MA_NO_SBRK
+void *ma_malloc(size_t size);
+void ma_free(void *ptr);
+void *ma_calloc(size_t nmemb, size_t size);
+void *ma_realloc(void *ptr, size_t size);
+int ma_posix_memalign(void **memptr, size_t alignment, size_t size);
+void *ma_aligned_alloc(size_t alignment, size_t size);
+void *ma_memalign(size_t alignment, size_t size);
+#endif
+
+/* allocate size bytes as close as possible to hint, which must be a live
+ * pointer returned by this allocator. useful for keeping linked nodes in
+ * the same cache lines and pages. */
+void *malloc_near(size_t size, void *hint);
+
+/* free ptr on a helper thread. the calling thread only stores ptr in a
+ * per-thread queue, falling back to a normal free if the queue is full. */
+void ma_free_async(void *ptr);
+
+/* if on is nonzero, every free on the calling thread behaves like
+ * ma_free_async. pass 0 to go back to freeing synchronously. */
+void ma_async_free_mode(int on);
+
+// wait until everything the calling thread queued has been freed
+void ma_async_flush(void);
+
+/* epoch based reclamation for lock-free structures. readers bracket their
+ * accesses with ma_epoch_enter and ma_epoch_exit; writers pass unlinked
+ * nodes to ma_retire instead of free, and they're freed once every reader
+ * that could still hold them has exited. ma_epoch_reclaim frees what the
+ * calling thread has retired as soon as it's safe. */
+void ma_epoch_enter(void);
+void ma_epoch_exit(void);
+void ma_retire(void *ptr);
+void ma_epoch_reclaim(void);
+
+/* heaps kept in a file, for data that should outlive the process. a heap
+ * can be mapped at a different address each time it's opened, so objects
+ * in it refer to each other by offset rather than by pointer -
+ * ma_pheap_offset and ma_pheap_ptr convert between the two. the root is
+ * where a program finds its data again after reopening the heap. */
+typedef struct ma_pheap ma_pheap;
+
+ma_pheap *ma_pheap_open(const char *path, size_t capacity);
+/* shared heaps work the same way but live in shared memory, and every
+ * process that maps one may free what the others allocated */
+ma_pheap *ma_shm_open(const char *name, size_t capacity);
+ma_pheap *ma_shm_attach(int fd, size_t capacity);
+void ma_pheap_close(ma_pheap *ph);
+void *ma_pmalloc(ma_pheap *ph, size_t size);
+void ma_pfree(ma_pheap *ph, void *ptr);
+void *ma_pheap_root(ma_pheap *ph);
+void ma_pheap_set_root(ma_pheap *ph, void *ptr);
+size_t ma_pheap_offset(ma_pheap *ph, const void *ptr);
+void *ma_pheap_ptr(ma_pheap *ph, size_t off);
+
+/* allocation tags, for finding out which part of a program owns its
+ * memory. allocations the calling thread makes after ma_set_tag(tag) are
+ * counted under tag, through realloc and until they're freed, whichever
+ * thread frees them. tags run from 1 to MA_TAGS - 1, and 0 turns tagging
+ * off. returns the thread's previous tag. */
+#define MA_TAGS 256
+unsigned ma_set_tag(unsigned tag);
+
+// counters describing the allocator's use of the system
+struct ma_stats {
+    // bytes pre-faulted at startup by MICROALLOC_RESERVE
+    size_t reserved;
+    // allocations that had to be placed outside that reservation
+    size_t outside_reserve;
+    // system calls made to grow a heap or map a new one
+    size_t grow_calls;
+    // bytes currently taken from the system for heaps and mappings
+    size_t footprint;
+    // the most footprint has been
+    size_t footprint_peak;
+    // times the soft limit made the allocator give memory back
+    size_t limit_reclaims;
+    // requests refused because of the hard limit
+    size_t limit_failures;
+    // live bytes allocated under each tag - see ma_set_tag
+    size_t tag_bytes[MA_TAGS];
+};
+
+// copy the allocator's counters into st
+void ma_get_stats(struct ma_stats *st);
+
+/* cold data. ma_malloc_cold allocates from a heap of its own, so objects
+ * that are rarely touched don't share pages with hot ones; free and
+ * realloc work on them as usual. ma_mark_cold tells the kernel that the
+ * whole pages inside ptr's allocation - or the entire cold heap if ptr is
+ * NULL - won't be needed soon, so they're reclaimed before other memory,
+ * or paged out right away if pageout is nonzero. needs linux 5.4; returns
+ * 0, or -1 with errno set. */
+void *ma_malloc_cold(size_t size);
+int ma_mark_cold(void *ptr, int pageout);
+
+/* defragmentation hint. if the object at ptr is on a heap page or in a
+ * slab run that's less than a quarter used, returns a new allocation of
+ * the same size on a page or run that holds more than ptr's would without
+ * it, so a caller that copies ptr's contents there and frees ptr helps the
+ * sparse page empty out. returns NULL if ptr should stay where it is,
+ * including when there's nowhere better for it. */
+void *ma_should_move(void *ptr);
+
+/* heap walking, for looking at fragmentation in a running process. every
+ * block the allocator manages is copied in one pass with the allocator
+ * locked, and fn is then called on each one with it unlocked, so fn may
+ * allocate and other threads only wait for the copy. ma_heap_visit returns
+ * how many blocks there were, or -1 with errno set. */
+enum { MA_KIND_HEAP, MA_KIND_SLAB, MA_KIND_BUDDY, MA_KIND_LARGE };
+enum { MA_ALLOCATED, MA_FREE, MA_UNSORTED, MA_QUICK };
+struct ma_block {
+    // start of the block - its header for heap blocks
+    void *addr;
+    size_t size;
+    unsigned char kind;
+    // MA_QUICK blocks are on a quick list or in a thread's cache
+    unsigned char state;
+    unsigned short tag;
+};
+typedef void ma_visit_fn(const struct ma_block *block, void *arg);
+long ma_heap_visit(ma_visit_fn *fn, void *arg);
+
+/* write the same snapshot to fd: a struct ma_dump_header followed by
+ * count records, in the byte order of the machine that wrote them.
+ * tools/heapmap renders it as a page occupancy map. returns 0, or -1 with
+ * errno set. */
+#define MA_DUMP_MAGIC 0x313050414548414dull
+struct ma_dump_header {
+    uint64_t magic;
+    uint64_t page_size;
+    uint64_t count;
+};
+struct ma_dump_record {
+    uint64_t addr;
+    uint64_t size;
+    uint8_t kind;
+    uint8_t state;
+    uint16_t tag;
+    uint32_t pad;
+};
+int ma_heap_dump(int fd);
+
+/* print how long sampled allocations lived, by size class and by malloc
+ * call site. requires MICROALLOC_PROFILE_LIFETIME=1; the same report is
+ * printed to stderr at exit. */
+void ma_lifetime_report(FILE *out);
+
+#endif
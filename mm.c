@@ -7,6 +7,7 @@
  * all pointers returned are guaranteed to be aligned to twice the
  * width of size_t - on most systems, this is 8 bytes
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <assert.h>
 #include <unistd.h>
@@ -15,17 +16,46 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "microalloc.h"
+#ifdef MA_CLASS_TABLE
+#include "size_classes.h"
+#endif
+
+/* MA_NO_SBRK builds the allocator to share a process with another one, as
+ * tools/simulate does. the main heap is mapped instead of growing at the
+ * program break, and the standard functions take an ma_ prefix so they
+ * don't replace the process's own. */
+#ifdef MA_NO_SBRK
+#define malloc(s)                ma_malloc(s)
+#define free(p)                  ma_free(p)
+#define calloc(n, s)             ma_calloc(n, s)
+#define realloc(p, s)            ma_realloc(p, s)
+#define posix_memalign(m, a, s)  ma_posix_memalign(m, a, s)
+#define aligned_alloc(a, s)      ma_aligned_alloc(a, s)
+#define memalign(a, s)           ma_memalign(a, s)
+#endif
 
 /*
  * free blocks are structured in memory as a one word header followed by
- * a next pointer, then a previous pointer. the location of the footer
- * varies based on the size of the block.
+ * a next link, then a previous link. the location of the footer varies
+ * based on the size of the block.
  * prologue and epilogue blocks only use the header.
+ * links are offsets from the base of the block's heap - see TOBLOCK.
  */
 typedef struct block {
     size_t size;
-    struct block *next;
-    struct block *prev;
+    uintptr_t next;
+    uintptr_t prev;
 } Block;
 
 // type for headers and footers
@@ -44,6 +74,9 @@ typedef struct block {
 #define MAXSMALL         504
 // number of free lists
 #define LISTCOUNT        75
+#if defined(MA_CLASS_TABLE) && CLASSLISTS >= LISTCOUNT
+#error "size_classes.h has more lists than LISTCOUNT"
+#endif
 
 // helper macros
 /* rounds up to the nearest multiple of ALIGNMENT */
@@ -61,7 +94,7 @@ typedef struct block {
 #define BLOCKTOUSER(b)    ((Block *)(((void *) b) + WSIZE))
 
 // get size of block
-#define SIZE(b)           ((b)->size & ~0x7) 
+#define SIZE(b)           ((b)->size & ~TAGBITS & ~0x7)
 // get the amount of a block that's allocated to the user
 #define USERSIZE(b)       (SIZE(b) - DSIZE)
 // get the block size required to hold u bytes of user memory
@@ -77,11 +110,33 @@ typedef struct block {
 // mark block as not free for coalescing
 #define MARKUNQUICK(b)    ((b)->size &= ~0x2)
 
-// mark block as allocated and not on a quick list
-#define MARKALLOC(b)      ((b)->size = ((b)->size & ~0x2) | 0x1)
+/* mark block as allocated, not on a quick list and not sampled - on a
+ * block coming off a free list, 0x4 was the purged bit below */
+#define MARKALLOC(b)      ((b)->size = ((b)->size & ~0x6) | 0x1)
 // mark block as free
 #define MARKFREE(b)       ((b)->size &= ~0x1)
 
+/* 1 if an allocated block has a record in the sample table. only set in
+ * the header - the footer copy is stale until the block is freed */
+#define ISSAMPLED(b)      ((b)->size & 0x4)
+#define MARKSAMPLED(b)    ((b)->size |= 0x4)
+#define MARKUNSAMPLED(b)  ((b)->size &= ~0x4)
+/* on free blocks the same bit means the block's interior pages have been
+ * given back to the system. it's cleared whenever the block is reinserted
+ * into a free list or taken off one. */
+#define ISPURGED(b)       ((b)->size & 0x4)
+#define MARKPURGED(b)     ((b)->size |= 0x4)
+/* an allocated block's tag, from ma_set_tag, is kept in the top bits of
+ * its header, above any size a block can have. 0 means untagged. */
+#define TAGSHIFT          56
+#define TAGBITS           (~(size_t) 0 << TAGSHIFT)
+#define TAG(b)            ((b)->size >> TAGSHIFT)
+#define SETTAG(b, t)      ((b)->size = ((b)->size & ~TAGBITS) | \
+                                       (size_t) (t) << TAGSHIFT)
+/* maintenance pass in which a free block big enough to purge was last put
+ * on a free list - stored in the word after the list links */
+#define FREEPASS(b)       (((size_t *) (b))[3])
+
 // set a block as allocated with size 0 - used for prologue/epilogue
 #define BOUNDINIT(b)      ({MARKALLOC(b); SETSIZEHDR(b, 0);})
 
@@ -113,47 +168,619 @@ typedef struct block {
 // get the coalescability of the next block in raw address space
 #define NEXTUNCOAL(b)     (NEXTRAW(b)->size & 0x3)
 
+/*
+ * a heap is one contiguous region of blocks with its own free lists. the
+ * main heap grows with the program break; others live in a reservation of
+ * address space from mmap and commit pages as they grow.
+ */
+typedef struct heap {
+    /* these blocks track the beginning and end of the region of memory
+     * being managed. */
+    Block *prologue;
+    Block *epilogue;
+    /* the first free list is the unsorted list. after that, blocks
+     * increase in size two words at a time, from the minimum size up to
+     * 504 bytes. blocks of size 512 bytes and up are spllit by powers of
+     * 2, with all blocks over 512 kilobytes sharing a list. */
+    uintptr_t free_lists[LISTCOUNT];
+    /* address that list links are offsets from. it's 0 for heaps in this
+     * process's memory, so their links are plain pointers; a file backed
+     * heap uses its mapping so it can be mapped anywhere. */
+    uintptr_t base;
+    /* end of committed memory - the break for brk heaps - and of the
+     * reservation, which is NULL for brk heaps */
+    void *top;
+    void *limit;
+    /* bytes in use on each huge page of the heap, counted from hp_base,
+     * with HPRELEASED set once an empty huge page is given back. only
+     * tracked in thp mode. */
+    uint32_t *hp_used;
+    uintptr_t hp_base;
+} Heap;
+
+/* convert between blocks and list links in heap h. a link of 0 ends a
+ * list - no block sits at offset 0 of any heap. */
+#define TOBLOCK(h, o)    ((o) ? (Block *) ((h)->base + (o)) : NULL)
+#define TOLINK(h, b)     ((b) ? (uintptr_t) (b) - (h)->base : 0)
+// follow the links of a free block, or get the head of a free list
+#define NEXT(h, b)       TOBLOCK(h, (b)->next)
+#define PREV(h, b)       TOBLOCK(h, (b)->prev)
+#define HEAD(h, i)       TOBLOCK(h, (h)->free_lists[i])
+
+// size of a transparent huge page
+#define HUGEPAGE         ((size_t) 2 << 20)
+// round n up or down to a multiple of a power of 2
+/* advice values from linux 5.4, for building against older headers. older
+ * kernels reject them with EINVAL. */
+#ifndef MADV_COLD
+#define MADV_COLD        20
+#endif
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT     21
+#endif
+
+#define ROUNDUP(n, a)    (((n) + (a) - 1) & ~((a) - 1))
+#define ROUNDDOWN(n, a)  ((n) & ~((a) - 1))
+
+// huge pages tracked per heap, and the parts of an occupancy entry
+#define HPSLOTS          (HEAPRESERVE / HUGEPAGE)
+#define HPRELEASED       0x80000000u
+#define HPUSED(e)        ((e) & ~HPRELEASED)
+/* number of fitting blocks in a free list compared when looking for the
+ * fullest huge page */
+#define HPSCAN           8
+
+/* a ring of pointers a thread has freed asynchronously, waiting for the
+ * helper thread. the owning thread only writes tail and the helper only
+ * writes head, so neither needs a lock. */
+#define RINGSIZE         1024
+typedef struct free_ring {
+    void *slots[RINGSIZE];
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    // owner's last look at head, so a push usually doesn't read it
+    size_t cached_head;
+    // set when the owning thread exits - the helper unmaps the ring
+    _Atomic bool orphaned;
+    struct free_ring *next;
+} FreeRing;
+
+/* a page of retired pointers. they're kept out of band because readers
+ * may still be looking at the payload when a pointer is retired. */
+typedef struct bag_chunk {
+    struct bag_chunk *next;
+    size_t count;
+    void *ptrs[];
+} BagChunk;
+
+#define BAGCHUNK         4096
+#define BAGSLOTS         ((BAGCHUNK - sizeof(BagChunk)) / sizeof(void *))
+
+/* a thread's state for epoch based reclamation. state is the global epoch
+ * the thread saw when it entered its critical section, shifted left one,
+ * with the low bit set while it's inside. retired pointers wait in one of
+ * three bags by the epoch they were retired in. */
+typedef struct epoch_rec {
+    _Atomic size_t state;
+    // cleared when the owning thread exits so the record can be reused
+    _Atomic bool in_use;
+    size_t nesting;
+    BagChunk *bags[3];
+    size_t bag_epoch[3];
+    // emptied chunks kept for reuse
+    BagChunk *spare;
+    size_t retired;
+    struct epoch_rec *next;
+} EpochRec;
+
+// retires between attempts to advance the global epoch
+#define EPOCHBATCH       64
+
+/* the header at the start of a file backed heap. the heap's pointers are
+ * rebased when the file is mapped at a new address; its free lists are
+ * offsets and need nothing. */
+typedef struct ma_pheap {
+    uint64_t magic;
+    size_t capacity;
+    // offset of the user's root object, or 0
+    uintptr_t root;
+    pthread_mutex_t lock;
+    Heap heap;
+} PHeap;
+
+#ifdef MA_CLASS_TABLE
+// a heap's lists are only usable by builds with the same classes
+#define PHEAPMAGIC       (0x70686561706d6131ull ^ CLASSID)
+#else
+#define PHEAPMAGIC       0x70686561706d6131ull
+#endif
+// offset of the prologue in a file backed heap
+#define PHEAPSTART       ROUNDUP(sizeof(PHeap) + WSIZE, DSIZE)
+
+/* metadata for a run of the slab region. a run holds objects of one size
+ * and a bit for each that is set while the object is free. runs of a size
+ * with free objects are chained through next, which is one more than the
+ * index of the next run so that 0 ends the chain. */
+#define SLABRUN          ((size_t) 64 << 10)
+#define SLABRESERVE      ((size_t) 1 << 34)
+// largest request served from the slab region, and its size classes
+#define SLABMAX          512
+#define SLABCLASSES      (SLABMAX / 16)
+typedef struct slab_run {
+    uint32_t size;
+    uint32_t nfree;
+    uint32_t next;
+    uint64_t free[SLABRUN / 16 / 64];
+    // tag of each object
+    uint8_t tags[SLABRUN / 16];
+} SlabRun;
+
+/* the page map is a two level radix tree over page numbers. a leaf covers
+ * 2^MAPLEAFBITS pages, and both levels are reserved without being
+ * committed, so only the parts covering large allocations use memory. */
+#define MAPLEAFBITS      18
+#define MAPBITS          48
+// freed large mappings of up to LARGEBINS pages are kept for reuse
+#define LARGEBINS        32
+#define LARGECACHE       ((size_t) 8 << 20)
+
+/* the buddy region serves requests from large_min up to BUDDYMAX in
+ * blocks of a power of two pages, aligned to their size. blocks of the
+ * largest order are committed from the reservation as needed. */
+#define BUDDYMAX         ((size_t) 1 << 20)
+#define BUDDYRESERVE     ((size_t) 1 << 36)
+// most orders for any page size, and free top order blocks kept resident
+#define BUDDYORDERS      21
+#define BUDDYKEEP        8
+// order map entry of a free top order block whose pages were given back
+#define BUDDYPURGED      0xff
+/* the links of a free buddy block into the list for its order, kept in
+ * a table by its first page rather than in the block, so freeing never
+ * writes to the region's pages. links are page numbers plus one, and 0
+ * ends a list. */
+typedef struct buddy_free {
+    uint32_t next;
+    uint32_t prev;
+} BuddyFree;
+
+/* quick lists - lock-free stacks of free blocks of each small size, one
+ * per multiple of 8 bytes. a head packs a 16 bit tag above a 48 bit block
+ * pointer, and the tag changes with every push and pop so a stale head
+ * can't be swapped back in. */
+#define QUICKLISTS       (MAXSMALL / 8 + 1)
+#define QUICKCAP         256
+#define QUICKPTR         (((uint64_t) 1 << 48) - 1)
+#define QUICKTAG(h)      (((h) & ~QUICKPTR) + ((uint64_t) 1 << 48))
+
+/* a thread's cache of small free blocks, with a stack per size like the
+ * quick lists. a size's capacity adapts to how it's used - a miss doubles
+ * it, and overflowing more often than missing halves it. the owner holds
+ * lock around every operation; reclaiming an idle cache only tries it. */
+typedef struct tcache_bin {
+    Block *head;
+    uint32_t count;
+    uint32_t max;
+    uint32_t misses;
+    uint32_t overflows;
+} TCacheBin;
+
+typedef struct tcache {
+    atomic_flag lock;
+    // bytes cached across all sizes
+    size_t bytes;
+    // operations so far, and as of the last look for idle caches
+    size_t ops;
+    size_t seen_ops;
+    TCacheBin bins[QUICKLISTS];
+    struct tcache *next;
+} TCache;
+
+#define TCACHEMIN        4
+#define TCACHEMAX        256
+// refills between looks for idle caches when there's no maintenance thread
+#define TCACHEGC         256
+
+/* ma_should_move flags objects on heap pages and in slab runs that are
+ * less than 1/MOVESPARSE used, and looks at up to MOVESCAN free blocks or
+ * runs for a place that's fuller */
+#define MOVESPARSE       4
+#define MOVESCAN         64
+
+// maximum number of mmap'd heaps
+#define MAXHEAPS         8
+// address space reserved for each mmap'd heap
+#define HEAPRESERVE      ((size_t) 1 << 36)
+
+// number of buckets in a lifetime histogram - bucket i counts ages below 2^i ns
+#define AGEBUCKETS       48
+
+/* a site is a call site of malloc, identified by its return address.
+ * sampled allocations teach each site how long its objects live, measured
+ * in calls to malloc. the profiler also keeps a histogram of ages in
+ * nanoseconds, and counts samples that were still live when dropped. */
+typedef struct site {
+    uintptr_t addr;
+    uint32_t  samples;
+    uint64_t  lifetime;
+    uint32_t  ages[AGEBUCKETS];
+    uint32_t  survivors;
+} Site;
+
+// an allocation being watched until it's freed
+typedef struct sample {
+    Block    *block;
+    Site     *site;
+    uint64_t  born;
+    uint64_t  born_ns;
+    int       list;
+} Sample;
+
+// number of entries in the site and sample tables - powers of 2
+#define SITESLOTS        1024
+#define SAMPLESLOTS      4096
+// lifetimes a site needs before it's trusted to be long lived
+#define SITEMINSAMPLES   4
+
 // internal functions
-static Block  *extend_heap(size_t);
-static void   split(Block *, size_t);
+static Block  *extend_heap(Heap *, size_t);
+static void   split(Heap *, Block *, size_t);
 static int    find_list_index(size_t);
-static Block  *find_in_list(Block *, size_t);
-static Block  *find_block(size_t);
-static void   free_list_insert(Block *, bool);
-static void   free_list_remove(Block *);
-static Block  *coalesce(Block *);
-
-/* these blocks track the beginning and end of the region of memory
- * being managed. */
-static Block *prologue; 
-static Block *epilogue;
-
-/* the first free list is the unsorted list. after that, blocks increase
- * in size two words at a time, from the minimum size up to 504 bytes.
- * blocks of size 512 bytes and up are spllit by powers of 2, with all
- * blocks over 512 kilobytes sharing a list. */
-static Block **free_lists;
+static Block  *find_in_list(Heap *, Block *, size_t);
+static Block  *find_block(Heap *, size_t);
+static void   free_list_insert(Heap *, Block *, bool);
+static void   free_list_remove(Heap *, Block *);
+static Block  *coalesce(Heap *, Block *);
+static void   *malloc_block(Heap *, size_t);
+static void   *site_malloc(size_t, void *);
+static Block  *find_near(Block *, size_t);
+static int    heap_map(Heap *);
+static void   hp_init(Heap *);
+static void   hp_account(Heap *, Block *, bool);
+static void   hp_release(Heap *, Block *);
+static Block  *find_dense(Heap *, Block *, size_t);
+static void   reserve_heap(size_t, bool);
+static void   *reserve_alloc(size_t);
+static void   free_block(Block *);
+static void   *realloc_block(void *, size_t);
+static void   purge_block(Heap *, Block *);
+static void   trim_heap(Heap *);
+static void   *maintenance(void *);
+static void   maintenance_start(void) __attribute__((constructor));
+static void   maintenance_spawn(void);
+static void   fork_prepare(void);
+static void   fork_parent(void);
+static void   fork_child(void);
+static FreeRing *ring_get(void);
+static bool   helper_spawn(void);
+static bool   ring_push(FreeRing *, void *);
+static void   *free_helper(void *);
+static EpochRec *epoch_rec_get(void);
+static void   epoch_advance(void);
+static void   bag_free(EpochRec *, int);
+static PHeap  *pheap_map(int, size_t, bool, bool);
+static void   pheap_rebase(PHeap *);
+static void   pheap_lock(PHeap *);
+static void   slab_init(void);
+static void   *slab_alloc(size_t);
+static void   *slab_take(uint32_t *);
+static void   slab_free(void *);
+static void   *slab_realloc(void *, size_t);
+static void   *large_alloc(size_t, size_t);
+static size_t large_pages(void *);
+static void   large_free(void *, size_t);
+static void   *large_realloc(void *, size_t, size_t);
+static void   *malloc_aligned(size_t, size_t);
+static Block  *quick_pop(size_t);
+static bool   quick_push(Block *);
+static bool   quick_flush(void);
+static TCache *tcache_get(void);
+static Block  *tcache_pop(TCache *, size_t);
+static Block  *tcache_refill(TCache *, size_t);
+static void   tcache_push(TCache *, Block *);
+static void   tcache_gc(void);
+static void   tcache_drain(TCache *);
+static void   tcache_empty(TCache *);
+static void   tcache_exit(void *);
+static void   tag_heap(Block *, unsigned);
+static void   tag_give(void *, unsigned);
+static unsigned tag_take(void *);
+static bool   footprint_grow(size_t);
+static struct ma_block *heap_snapshot(size_t *, size_t *);
+static size_t page_live(Block *, uintptr_t);
+static bool   snap_add(void *, size_t, int, int, unsigned);
+static bool   limit_soft(size_t);
+static void   limit_reclaim(void);
+static size_t cgroup_limit(const char *);
+static void   buddy_init(void);
+static void   *buddy_alloc(size_t);
+static void   buddy_free(void *);
+static void   *buddy_realloc(void *, size_t);
+static Heap   *heap_of(Block *);
+static Heap   *choose_heap(void *);
+static void   sample_alloc(Block *);
+static void   sample_free(Block *, bool);
+static void   print_age(FILE *, uint64_t);
+static void   lifetime_exit(void) __attribute__((destructor));
+
+// the heap at the program break - used unless a mode picks another one
+static Heap main_heap;
+
+// mmap'd heaps, searched by address when blocks are freed
+static Heap *mapped_heaps[MAXHEAPS];
+static int mapped_count;
+
+/* lifetime segregation - when enabled, sites whose objects tend to outlive
+ * long_lived calls to malloc allocate from long_heap so they don't pin
+ * free ranges between short lived objects in the main heap. */
+static bool segregate;
+static size_t long_lived;
+static size_t sample_interval;
+static size_t sample_countdown;
+static uint64_t alloc_clock;
+static Heap long_heap;
+static Site sites[SITESLOTS];
+static Sample samples[SAMPLESLOTS];
+// site of the allocation in progress - set by choose_heap
+static Site *curr_site;
+
+/* cold data - ma_malloc_cold allocates from cold_heap so rarely touched
+ * objects don't share pages with hot ones. it's mapped on first use, and
+ * its blocks bypass the quick lists and thread caches so nothing hot is
+ * ever placed in it. */
+static Heap cold_heap;
+
+/* lifetime profiling - sampled allocations are timestamped, and their ages
+ * at free are kept per call site and per size class */
+static bool profile_lifetime;
+static size_t short_lived_us;
+static uint32_t class_ages[LISTCOUNT][AGEBUCKETS];
+static uint32_t class_survivors[LISTCOUNT];
+
+// size of a page in bytes - set by malloc_init
+static size_t page_size;
+
+/* placement policy. blocks are only split when at least split_min bytes
+ * would be left over, and with addr_order the main lists are kept in
+ * address order rather than putting freed blocks first, so the lowest
+ * block that fits is taken. */
+static size_t split_min;
+static bool addr_order;
+
+/* startup reservation - a range of the main heap that was pre-faulted,
+ * and optionally locked, so allocations inside it never cause page faults
+ * or system calls */
+static void *reserve_start, *reserve_end;
+
+// counters reported by ma_get_stats
+static struct ma_stats stats;
+
+/* every heap, the sample and site tables and the counters are protected by
+ * heap_lock. public functions take it and call internal ones that assume
+ * it's held. */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* background maintenance - when bg_interval_ms is set, a thread wakes up
+ * that often to drain the unsorted lists, purge free pages that have
+ * stayed free for a whole pass and trim free space off the end of each
+ * heap. free then leaves coalescing to the thread, and find_block only
+ * drains unsorted_cap blocks per call. */
+static size_t bg_interval_ms;
+static size_t unsorted_cap;
+static size_t trim_threshold;
+static size_t bg_pass;
+/* the next block the maintenance thread's purge walk will look at, kept
+ * while it drops heap_lock. free_list_remove clears it if that block
+ * leaves its list meanwhile. */
+static Block *bg_cursor;
+// blocks handled per hold of heap_lock by the maintenance thread
+#define BGBATCH          64
+// madvise calls made per hold of heap_lock by the maintenance thread
+#define BGPURGES         8
+
+/* asynchronous free - rings of every thread that has used ma_free_async
+ * or turned on async_free, drained by free_helper. rings_lock protects
+ * the list itself. the per-thread state uses the initial-exec tls model so
+ * touching it never allocates. */
+static FreeRing *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static bool helper_started;
+static __thread FreeRing *my_ring __attribute__((tls_model("initial-exec")));
+static __thread bool async_free __attribute__((tls_model("initial-exec")));
+
+/* epoch based reclamation - a pointer retired in epoch e is freed once the
+ * global epoch reaches e + 2, by which point every thread has left any
+ * critical section that could still see it. records are never unmapped,
+ * so the list can be walked without a lock; epoch_lock serializes adding
+ * and reusing records and reaping the bags of exited threads. */
+static _Atomic size_t global_epoch;
+static EpochRec *_Atomic epoch_recs;
+static pthread_mutex_t epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_key_once = PTHREAD_ONCE_INIT;
+static __thread EpochRec *my_epoch_rec
+    __attribute__((tls_model("initial-exec")));
+
+/* heaps grow in multiples of grow_step bytes with their ends aligned to
+ * it, or by exactly what's needed if it's 0. in thp mode the step is at
+ * least a huge page and new memory is advised to use huge pages. */
+static size_t grow_step;
+static bool thp;
+
+/* fork friendly mode - small requests come from the slab region, whose
+ * allocation bits and run lists live in slab_runs, mapped separately. a
+ * free there only writes a metadata page, so after a fork the parent
+ * doesn't copy the pages its frees land on. slab_base is NULL when the
+ * mode is off. */
+static void *slab_base;
+static SlabRun *slab_runs;
+static size_t slab_count;
+static uint32_t slab_partial[SLABCLASSES];
+/* blocks on quick lists keep their allocated bit and also have the quick
+ * bit set, so they're never coalesced and can be taken off without the
+ * lock. counts are approximate and only cap how much the lists hold -
+ * they're reset whenever the lists are flushed. */
+static bool quick_on;
+static _Atomic uint64_t quick_heads[QUICKLISTS];
+static _Atomic long quick_counts[QUICKLISTS];
+// calls to quick_pop under way, which keep trim_heap from unmapping
+static _Atomic long quick_poppers;
+// adjust a count without a locked instruction - losing an update is fine
+#define QUICKCOUNT(i, d) atomic_store_explicit(&quick_counts[i], \
+        atomic_load_explicit(&quick_counts[i], memory_order_relaxed) + (d), \
+        memory_order_relaxed)
+
+/* thread caches - each thread holds up to tcache_bytes of small blocks it
+ * can use without any atomic operation but its own uncontended spinlock.
+ * caches that see no use between two looks are emptied back into the
+ * heap. tcaches_lock protects the list and is held while emptying. */
+static size_t tcache_bytes;
+static TCache *tcaches;
+static pthread_mutex_t tcaches_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+static size_t tcache_refills;
+static __thread TCache *my_tcache __attribute__((tls_model("initial-exec")));
+// set once the thread's cache is gone, so exiting doesn't make a new one
+static __thread bool tcache_done __attribute__((tls_model("initial-exec")));
+
+/* requests of at least large_min bytes get their own page aligned mapping.
+ * their sizes are kept in page_map, indexed by the first page, rather than
+ * in a header, so the whole mapping belongs to the caller. */
+static size_t large_min;
+static size_t **page_map;
+static int page_shift;
+static void *large_cache[LARGEBINS];
+static size_t large_cached;
+
+/* buddy allocator state. a block's order is kept, plus one, in buddy_order
+ * at its first page while it's allocated. buddy_bits has a bitmap per
+ * order with a bit per block of that order, set while the block is free,
+ * so a block's buddy - found by flipping the bit of its page index for
+ * its order - can be checked without touching the buddy's memory. */
+static void *buddy_base;
+static size_t buddy_chunks;
+static int buddy_orders;
+static uint8_t *buddy_order;
+// tag of each allocated block, also at its first page
+static uint8_t *buddy_tag;
+static uint64_t *buddy_bits[BUDDYORDERS];
+static BuddyFree *buddy_links;
+static uint32_t buddy_lists[BUDDYORDERS];
+static size_t buddy_free_top;
+
+/* allocation tags - live bytes per tag, counted only for tagged blocks so
+ * untagged ones cost nothing. tags_used is set once any thread picks a
+ * tag, and until then frees don't look for one. */
+static _Atomic size_t tag_bytes[MA_TAGS];
+static bool tags_used;
+static __thread unsigned my_tag __attribute__((tls_model("initial-exec")));
+
+/* memory limits - footprint is what the heaps, slab and buddy regions and
+ * large mappings have taken from the system. past soft_limit, free memory
+ * is given back before taking more, at most once per soft_limit / 16 of
+ * growth; nothing grows past hard_limit. 0 means no limit. */
+static size_t soft_limit, hard_limit, soft_next;
+// set by limit_reclaim to have the next tcache_gc empty every cache
+static _Atomic bool tcache_flush_all;
+
+#define INBUDDY(p)       (buddy_base != NULL && (void *) (p) >= buddy_base && \
+                          (void *) (p) < buddy_base + BUDDYRESERVE)
+#define INSLAB(p)        (slab_base != NULL && (void *) (p) >= slab_base && \
+                          (void *) (p) < slab_base + SLABRESERVE)
+#define INCOLD(p)        (cold_heap.limit != NULL && \
+                          (void *) (p) > (void *) cold_heap.prologue && \
+                          (void *) (p) < cold_heap.limit)
+/* in the main heap. a live block is always below the epilogue, so it's
+ * safe to check without the lock. */
+#define INMAIN(p)        ((void *) (p) > (void *) main_heap.prologue && \
+                          (void *) (p) < (void *) main_heap.epilogue)
+
+/* read a numeric tuning option from the environment, allowing a k, m or g
+ * suffix. returns def if the variable isn't set or can't be parsed. */
+static size_t env_opt(const char *name, size_t def)
+{
+    char *val = getenv(name), *end;
+    size_t n;
+
+    if (val == NULL || *val == '\0')
+        return def;
+    n = strtoull(val, &end, 0);
+    switch (*end) {
+    case 'g': case 'G': n <<= 10; /* fall through */
+    case 'm': case 'M': n <<= 10; /* fall through */
+    case 'k': case 'K': n <<= 10; end++; break;
+    }
+    return *end == '\0' ? n : def;
+}
 
 /* malloc_init - initialize the allocator. creates the prologue with
- * correct alignment and gets room for the free lists. */
+ * correct alignment and reads tuning options from the environment. */
 static int malloc_init(void)
 {
     static int init;
+#ifndef MA_NO_SBRK
     size_t pad_bytes, req_bytes;
     void *old_brk;
+#endif
 
     if (init > 0) return 0;
 
-    // get room for free_lists and initialize all to NULL
-    if ((free_lists = (Block **) sbrk(sizeof(Block *) * LISTCOUNT)) == \
-        (void *) -1) {
-        fprintf(stderr, "malloc_init: couldn't acquire memory for "
-                        "free_lists\n");
-        errno = ENOMEM;
-        return -1;
+    page_size = (size_t) sysconf(_SC_PAGESIZE);
+    page_shift = __builtin_ctzll(page_size);
+
+    segregate = env_opt("MICROALLOC_SEGREGATE", 0);
+    long_lived = env_opt("MICROALLOC_LONG_LIVED", 1 << 16);
+    profile_lifetime = env_opt("MICROALLOC_PROFILE_LIFETIME", 0);
+    short_lived_us = env_opt("MICROALLOC_SHORT_LIVED_US", 1000);
+    sample_interval = env_opt("MICROALLOC_SAMPLE_INTERVAL", 64);
+    if (sample_interval == 0)
+        sample_interval = 1;
+    sample_countdown = sample_interval;
+
+    thp = env_opt("MICROALLOC_THP", 0);
+    grow_step = env_opt("MICROALLOC_GROW", 0);
+    if (grow_step != 0)
+        grow_step = (size_t) 1 << (64 - __builtin_clzll(grow_step - 1));
+    if (thp && grow_step < HUGEPAGE)
+        grow_step = HUGEPAGE;
+
+    bg_interval_ms = env_opt("MICROALLOC_BG_INTERVAL_MS", 0);
+    unsorted_cap = env_opt("MICROALLOC_UNSORTED_CAP",
+                           bg_interval_ms != 0 ? 16 : SIZE_MAX);
+    trim_threshold = env_opt("MICROALLOC_TRIM", 1 << 20);
+    large_min = env_opt("MICROALLOC_LARGE", page_size);
+    split_min = ROUNDUP(env_opt("MICROALLOC_SPLIT_MIN", MINBLOCK), WSIZE);
+    if (split_min < MINBLOCK)
+        split_min = MINBLOCK;
+    addr_order = env_opt("MICROALLOC_ADDR_ORDER", 0);
+    // sampled allocations have to go through site_malloc
+    quick_on = env_opt("MICROALLOC_QUICK", 1) && !segregate &&
+               !profile_lifetime;
+    if (quick_on)
+        tcache_bytes = env_opt("MICROALLOC_TCACHE", 256 << 10);
+    // the cgroup's limits apply unless the environment sets them
+    if (env_opt("MICROALLOC_CGROUP", 0)) {
+        hard_limit = cgroup_limit("memory.max");
+        if ((soft_limit = cgroup_limit("memory.high")) == 0)
+            soft_limit = hard_limit - hard_limit / 8;
     }
-    memset(free_lists, 0, sizeof(Block *) * LISTCOUNT);
+    hard_limit = env_opt("MICROALLOC_HARD_LIMIT", hard_limit);
+    soft_limit = env_opt("MICROALLOC_SOFT_LIMIT", soft_limit);
+    soft_next = soft_limit;
+    if (env_opt("MICROALLOC_BUDDY", 1))
+        buddy_init();
+    if (env_opt("MICROALLOC_COW", 0))
+        slab_init();
 
+#ifdef MA_NO_SBRK
+    // the break belongs to the process's own allocator
+    if (heap_map(&main_heap) < 0) {
+        fprintf(stderr, "malloc_init: couldn't map the main heap\n");
+        return -1;
+    }
+#else
     // check if padding bytes are needed
     if ((old_brk = sbrk(0)) == (void *)(-1)) {
         fprintf(stderr, "malloc_init: couldn't check current brk\n");
@@ -162,6 +789,10 @@ static int malloc_init(void)
     }
 
     pad_bytes = ALIGN((uintptr_t)old_brk) - (uintptr_t) old_brk;
+    // start on a huge page so that every grow_step of the heap fills one
+    if (thp)
+        pad_bytes = ROUNDUP((uintptr_t) old_brk, HUGEPAGE) -
+                    (uintptr_t) old_brk;
     /* request enough bytes for padding + prologue + epilogue. aligning 
      * here ensures that the end of the new chunk is DWORD aligned. */
     req_bytes = ALIGN(pad_bytes + WSIZE + sizeof(Block));
@@ -172,14 +803,21 @@ static int malloc_init(void)
     }
     
     // initialize chunk - new prologue starts at old_brk + pad_bytes
-    prologue = (Block *) (old_brk + pad_bytes);
+    main_heap.top = old_brk + req_bytes;
+    main_heap.prologue = (Block *) (old_brk + pad_bytes);
     // epilogue starts after after prologue
-    epilogue = (Block *) ((void *) prologue + WSIZE);
+    main_heap.epilogue = (Block *) ((void *) main_heap.prologue + WSIZE);
 
     // initialize prologue and epilogue
-    BOUNDINIT(prologue);
-    BOUNDINIT(epilogue);
+    BOUNDINIT(main_heap.prologue);
+    BOUNDINIT(main_heap.epilogue);
+    if (thp)
+        hp_init(&main_heap);
+#endif
     init = 1;
+
+    reserve_heap(env_opt("MICROALLOC_RESERVE", 0),
+                 env_opt("MICROALLOC_MLOCK", 0));
     return 0;
 }
 
@@ -189,42 +827,169 @@ static int malloc_init(void)
  */
 void *malloc(size_t size)
 {
-    Block *found_block, *last_in_heap;
+    void *userptr = NULL;
+    TCache *tc;
+    Block *b;
+    size_t i;
 
-    if (malloc_init() < 0) {
+    if (size == 0) {
+        return NULL;
+    }
+
+    // align the request size to preserve block alignment
+    if (size > ALIGN(BLOCKSIZE(size))) {
+        fprintf(stderr, "malloc: request too large\n");
+        errno = ENOMEM;
         return NULL;
     }
+    /* small sizes come from the thread's cache, or else the quick lists,
+     * without the lock */
+    if (quick_on && ALIGN(BLOCKSIZE(size)) <= MAXSMALL &&
+        (slab_base == NULL || size > SLABMAX)) {
+        i = ALIGN(BLOCKSIZE(size)) / 8;
+        if (tcache_bytes != 0 && (tc = tcache_get()) != NULL &&
+            ((b = tcache_pop(tc, i)) != NULL ||
+             (b = tcache_refill(tc, i)) != NULL)) {
+            if (my_tag != 0)
+                tag_heap(b, my_tag);
+            return BLOCKTOUSER(b);
+        }
+        if ((b = quick_pop(i)) != NULL) {
+            if (my_tag != 0)
+                tag_heap(b, my_tag);
+            return BLOCKTOUSER(b);
+        }
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    if (malloc_init() == 0) {
+        if (size >= large_min)
+            userptr = large_alloc(size, 0);
+        else if (slab_base != NULL && size <= SLABMAX)
+            userptr = slab_alloc(size);
+        else
+            userptr = site_malloc(ALIGN(BLOCKSIZE(size)),
+                                  __builtin_return_address(0));
+        if (my_tag != 0 && userptr != NULL)
+            tag_give(userptr, my_tag);
+    }
+    pthread_mutex_unlock(&heap_lock);
+    // empty thread caches if a limit was hit while the lock was held
+    if (tcache_flush_all)
+        tcache_gc();
+    return userptr;
+}
+
+/* allocate an aligned block size on behalf of the malloc call at caller.
+ * the call site picks the heap, and every sample_interval allocations one
+ * is watched to learn how long the site's objects live. */
+static void *site_malloc(size_t size, void *caller)
+{
+    Heap *h = choose_heap(caller);
+    void *userptr = malloc_block(h, size);
+
+    if ((segregate || profile_lifetime) && userptr != NULL &&
+        --sample_countdown == 0) {
+        sample_countdown = sample_interval;
+        sample_alloc(USERTOBLOCK(userptr));
+    }
+    return userptr;
+}
+
+/* malloc_near - allocate a block as close as possible to hint, which must
+ * be a pointer currently allocated by malloc. the raw neighbors of hint's
+ * block are tried first, then any free block in the same page. if none of
+ * those are big enough, this is the same as malloc. */
+void *malloc_near(size_t size, void *hint)
+{
+    Block *found_block, *tail;
+    Heap *h;
+    void *userptr;
+    size_t block_size;
+
+    // slab objects and large blocks have no neighbors to search
+    if (hint == NULL || INSLAB(hint) || INBUDDY(hint) || size >= large_min) {
+        return malloc(size);
+    }
 
     if (size == 0) {
         return NULL;
     }
 
-    // align the request size to preserve block alignment
     if (size > ALIGN(BLOCKSIZE(size))) {
-        fprintf(stderr, "malloc: request too large\n");
+        fprintf(stderr, "malloc_near: request too large\n");
         errno = ENOMEM;
         return NULL;
     }
-    size = ALIGN(BLOCKSIZE(size));
+    block_size = ALIGN(BLOCKSIZE(size));
+
+    pthread_mutex_lock(&heap_lock);
+    // stay in the hint's heap even if the call site would pick another
+    if (large_pages(hint) != 0 || (h = heap_of(USERTOBLOCK(hint))) == NULL) {
+        pthread_mutex_unlock(&heap_lock);
+        return malloc(size);
+    }
+    if ((found_block = find_near(USERTOBLOCK(hint), block_size)) == NULL) {
+        userptr = malloc_block(h, block_size);
+    } else if (found_block < USERTOBLOCK(hint) &&
+               SIZE(found_block) - block_size >= split_min) {
+        /* the block is below the hint, so take its end, which is nearest,
+         * and leave the front free */
+        free_list_remove(h, found_block);
+        tail = (Block *) ((void *) found_block + SIZE(found_block) -
+                          block_size);
+        SETSIZE(found_block, SIZE(found_block) - block_size);
+        free_list_insert(h, found_block, true);
+        tail->size = 0;
+        MARKALLOC(tail);
+        SETSIZE(tail, block_size);
+        userptr = BLOCKTOUSER(tail);
+    } else {
+        free_list_remove(h, found_block);
+        split(h, found_block, block_size);
+        userptr = BLOCKTOUSER(found_block);
+    }
+    if (my_tag != 0 && userptr != NULL)
+        tag_give(userptr, my_tag);
+    pthread_mutex_unlock(&heap_lock);
+    return userptr;
+}
+
+/* find or create a block for an aligned block size in heap h and hand it
+ * to the user - shared by malloc, malloc_near and realloc */
+static void *malloc_block(Heap *h, size_t size)
+{
+    Block *found_block, *last_in_heap, *new_block;
 
     // search for a block
-    found_block = find_block(size);
+    found_block = find_block(h, size);
+    /* the quick lists may have been hoarding enough to fit it. they only
+     * hold process heap blocks, and flushing them needs heap_lock, which
+     * callers only hold for process heaps. */
+    if (found_block == NULL && h->base == 0 && quick_on && quick_flush())
+        found_block = find_block(h, size);
+    if (found_block == NULL && h->base == 0 && limit_soft(size))
+        found_block = find_block(h, size);
     if (found_block == NULL) {
         // expand the heap to create room for the request
-        last_in_heap = PREVRAW(epilogue);
+        last_in_heap = PREVRAW(h->epilogue);
         if (!ISALLOC(last_in_heap)) {
             /* can extend the last block in the heap instead of creating
-             * an entirely new one */
+             * an entirely new one. it may already be big enough if it's
+             * on the unsorted list beyond where find_block looked. */
             found_block = last_in_heap;
-            if (extend_heap(size - SIZE(found_block)) == NULL) {
-                // pass error up the stack
-                return NULL;
+            if (SIZE(found_block) < size) {
+                new_block = extend_heap(h, size - SIZE(found_block));
+                if (new_block == NULL) {
+                    // pass error up the stack
+                    return NULL;
+                }
+                free_list_remove(h, found_block);
+                SETSIZE(found_block, SIZE(found_block) + SIZE(new_block));
             }
-            free_list_remove(found_block);
-            SETSIZE(found_block, size);
         } else {
             // extend the heap enough to make a whole new block
-            if ((found_block = extend_heap(size)) == NULL) {
+            if ((found_block = extend_heap(h, size)) == NULL) {
                 // pass error up the stack
                 return NULL;
             }
@@ -234,11 +999,17 @@ void *malloc(size_t size)
     if (!ISALLOC(found_block)) {
         /* block was obtained from a free list, not just by extending the 
          * heap - remove it from that list */
-        free_list_remove(found_block);
+        free_list_remove(h, found_block);
     }
 
     // if the new block doesn't need all the space found, don't take it all
-    split(found_block, size);
+    split(h, found_block, size);
+
+    // file backed heaps keep no stats
+    if (reserve_end != NULL && h->base == 0 &&
+        ((void *) found_block < reserve_start ||
+                                (void *) found_block >= reserve_end))
+        stats.outside_reserve++;
    
     return BLOCKTOUSER(found_block);
 }
@@ -254,19 +1025,82 @@ void *malloc(size_t size)
  */
 void free(void *ptr)
 {
+    TCache *tc;
+
     if (ptr == NULL) {
         return; // do nothing with null pointers
     }
+    // in async mode, the helper thread does the work
+    if (async_free && ring_push(my_ring, ptr)) {
+        return;
+    }
+    /* small main heap blocks go to the thread's cache, or else the quick
+     * lists, without the lock. large blocks are page aligned, and slab,
+     * buddy, cold and other heaps' blocks are outside the main heap. */
+    if (quick_on && ((uintptr_t) ptr & (page_size - 1)) != 0 &&
+        INMAIN(ptr) && SIZE(USERTOBLOCK(ptr)) <= MAXSMALL &&
+        !ISSAMPLED(USERTOBLOCK(ptr))) {
+        if (TAG(USERTOBLOCK(ptr)) != 0)
+            tag_heap(USERTOBLOCK(ptr), 0);
+        if (tcache_bytes != 0 && (tc = tcache_get()) != NULL) {
+            tcache_push(tc, USERTOBLOCK(ptr));
+            return;
+        }
+        if (quick_push(USERTOBLOCK(ptr)))
+            return;
+    }
+    pthread_mutex_lock(&heap_lock);
+    free_block(USERTOBLOCK(ptr));
+    pthread_mutex_unlock(&heap_lock);
+}
+
+// put an allocated block back on its heap's unsorted list
+static void free_block(Block *b)
+{
+    Heap *h;
+    size_t pages;
+
+    if (tags_used)
+        tag_take(BLOCKTOUSER(b));
+    if (INSLAB(BLOCKTOUSER(b))) {
+        slab_free(BLOCKTOUSER(b));
+        return;
+    }
+    if (INBUDDY(BLOCKTOUSER(b))) {
+        buddy_free(BLOCKTOUSER(b));
+        return;
+    }
+    if ((pages = large_pages(BLOCKTOUSER(b))) != 0) {
+        large_free(BLOCKTOUSER(b), pages);
+        return;
+    }
+    if ((h = heap_of(b)) == NULL) {
+        fprintf(stderr, "free: %p wasn't allocated here\n", BLOCKTOUSER(b));
+        return;
+    }
+    if (ISSAMPLED(b)) {
+        sample_free(b, true);
+    }
+    if (bg_interval_ms != 0) {
+        // the maintenance thread coalesces and purges
+        free_list_insert(h, b, true);
+        return;
+    }
     // coalesce both when putting on and taking off the unsorted list
-    Block *b = coalesce(USERTOBLOCK(ptr));
-    free_list_insert(b, true);
+    b = coalesce(h, b);
+    free_list_insert(h, b, true);
+    if (h->hp_used != NULL)
+        hp_release(h, b);
+    // with no maintenance thread, the end of the heap is trimmed here
+    if (NEXTRAW(b) == h->epilogue && SIZE(b) >= trim_threshold)
+        trim_heap(h);
 }
 
 /* allocate a region of memory for nmemb objects of the given size and
  * set all bytes in that region to 0. */
 void *calloc(size_t nmemb, size_t size)
 {
-    Block *userptr;
+    Block *userptr = NULL;
     size_t total_size = nmemb * size;
 
     // check for overflow
@@ -275,7 +1109,29 @@ void *calloc(size_t nmemb, size_t size)
         return NULL;
     }
     
-    userptr = malloc(total_size);
+    if (total_size == 0) {
+        return NULL;
+    }
+    if (total_size > ALIGN(BLOCKSIZE(total_size))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_mutex_lock(&heap_lock);
+    if (malloc_init() == 0) {
+        if (total_size >= large_min)
+            userptr = large_alloc(total_size, 0);
+        else if (slab_base != NULL && total_size <= SLABMAX)
+            userptr = slab_alloc(total_size);
+        else
+            // attribute the allocation to calloc's caller, not calloc
+            userptr = site_malloc(ALIGN(BLOCKSIZE(total_size)),
+                                  __builtin_return_address(0));
+        if (my_tag != 0 && userptr != NULL)
+            tag_give(userptr, my_tag);
+    }
+    pthread_mutex_unlock(&heap_lock);
+    if (tcache_flush_all)
+        tcache_gc();
     if (userptr == NULL) {
         return NULL;
     }
@@ -288,21 +1144,71 @@ void *calloc(size_t nmemb, size_t size)
  * move the block. */
 void *realloc(void *ptr, size_t size)
 {
-    Block *new;
-    Block *b;
-    size_t old_size, new_size;
-    size_t original_size;
+    void *new;
+    unsigned tag;
 
     if (ptr == NULL)
         return malloc(size);
-    if (size == 0)
+    if (size == 0) {
         free(ptr);
+        return NULL;
+    }
+    if (size > ALIGN(BLOCKSIZE(size))) {
+        errno = ENOMEM;
+        return NULL;
+    }
 
+    pthread_mutex_lock(&heap_lock);
+    // the block keeps its tag wherever it ends up
+    tag = tags_used ? tag_take(ptr) : 0;
+    new = realloc_block(ptr, size);
+    if (tag != 0)
+        tag_give(new != NULL ? new : ptr, tag);
+    pthread_mutex_unlock(&heap_lock);
+    if (tcache_flush_all)
+        tcache_gc();
+    return new;
+}
+
+// resize the allocation at ptr to size bytes - the body of realloc
+static void *realloc_block(void *ptr, size_t size)
+{
+    Block *new;
+    Block *b, *new_block;
+    Heap *h;
+    size_t old_size, new_size;
+    size_t original_size, pages;
+
+    if (INSLAB(ptr))
+        return slab_realloc(ptr, size);
+    if (INBUDDY(ptr))
+        return buddy_realloc(ptr, size);
+    if ((pages = large_pages(ptr)) != 0)
+        return large_realloc(ptr, pages, size);
+    // cold blocks stay in the cold heap at any size
+    if (size >= large_min && !INCOLD(ptr)) {
+        // growing into a large mapping of its own
+        if ((new = large_alloc(size, 0)) == NULL)
+            return NULL;
+        b = USERTOBLOCK(ptr);
+        memcpy(new, ptr, USERSIZE(b) < size ? USERSIZE(b) : size);
+        free_block(b);
+        return new;
+    }
     // convert user size to block size and align
     size = ALIGN(BLOCKSIZE(size));
 
     b = USERTOBLOCK(ptr);
+    if ((h = heap_of(b)) == NULL) {
+        fprintf(stderr, "realloc: %p wasn't allocated here\n", ptr);
+        errno = EINVAL;
+        return NULL;
+    }
     original_size = USERSIZE(b);
+    // the header may move while coalescing, so stop tracking the block
+    if (ISSAMPLED(b)) {
+        sample_free(b, false);
+    }
 
     /* coalesce the current block in hopes that this will create enough
      * room for the new size - even if that's not the case, the coalescing
@@ -310,7 +1216,7 @@ void *realloc(void *ptr, size_t size)
     if (size > SIZE(b)) {
         do {
             old_size = SIZE(b);
-            b = coalesce(b);
+            b = coalesce(h, b);
         } while (SIZE(b) > old_size);
     }
 
@@ -318,11 +1224,12 @@ void *realloc(void *ptr, size_t size)
         // if b is the last block in the heap, simply extend the heap.
         // malloc would do this too, but not before searching more free 
         // lists than necessary.
-        if (NEXTRAW(b) == epilogue) {
-            if (extend_heap(size - SIZE(b)) == NULL) {
+        if (NEXTRAW(b) == h->epilogue) {
+            if ((new_block = extend_heap(h, size - SIZE(b))) == NULL) {
                 return NULL;
             }
-            SETSIZE(b, size);
+            // the heap may have grown by more than was asked for
+            SETSIZE(b, SIZE(b) + SIZE(new_block));
             new = BLOCKTOUSER(b);
             /* TODO in certain cases, b will be marked as free after 
              * coalescing - there is room for improvement there */
@@ -331,8 +1238,8 @@ void *realloc(void *ptr, size_t size)
                 HDRTOFTR(b);
             }
         } else {
-            // need to move the block
-            new = malloc(size);
+            // need to move the block - keep it in the same heap
+            new = malloc_block(h, size);
             if (new == NULL) {
                 errno = ENOMEM;
                 return NULL;
@@ -341,11 +1248,14 @@ void *realloc(void *ptr, size_t size)
         if (new != ptr) { // avoid unnnecessary memmove calls
             memmove(new, ptr, original_size);
         }
-        /* the old block should only be freed if it doesn't overlap at all
-         * with the new block. if the new block is at a lower address, then
-         * they do overlap. */
-        if (ptr < (void *) new) {
-            free(ptr);
+        /* if the block moved, release what's left of the old one. b may
+         * have absorbed free neighbors while coalescing, so it's b that
+         * gets freed rather than ptr's original header */
+        if (new != BLOCKTOUSER(b)) {
+            b = coalesce(h, b);
+            free_list_insert(h, b, true);
+        } else {
+            split(h, b, size);
         }
     } else {
         /* either the block is being shrunk or coalescing created
@@ -356,7 +1266,7 @@ void *realloc(void *ptr, size_t size)
 
         if (!ISALLOC(b)) {
             /* see above todo comment*/
-            free_list_remove(b);
+            free_list_remove(h, b);
         }
         
         if (new != ptr) { // avoid unnecessary memmove calls
@@ -364,182 +1274,770 @@ void *realloc(void *ptr, size_t size)
         }
         /* split after moving data so data isn't overwritten in case of
          * a shrink */
-        split(b, size);
+        split(h, b, size);
     }
 
     return new;
 }
 
-// ask the operating system for more memory.
-static Block *extend_heap(size_t size)
+/* ask the operating system for more memory for heap h. returns a new
+ * allocated block at the end of the heap of at least size bytes - more if
+ * the heap grows in steps. */
+static Block *extend_heap(Heap *h, size_t size)
 {
     Block *new_block;
+    void *new_top;
 
-    /* current break is the end of the current epilogue - request the
-     * arg amount of bytes rounded up to be DWORD aligned, and 
-     * the old epilogue is overwritten and alignment is preserved */
-    if (sbrk(size) == (void *) -1) {
-        fprintf(stderr, "req_memory failed: ran out of memory\n");
-        errno = ENOMEM;
-        return NULL;
+    if (h->limit == NULL) {
+        // keep the break on a grow_step boundary
+        if (grow_step != 0)
+            size = ROUNDUP((uintptr_t) h->top + size, grow_step) -
+                   (uintptr_t) h->top;
+        /* current break is the end of the current epilogue - request the
+         * arg amount of bytes rounded up to be DWORD aligned, and 
+         * the old epilogue is overwritten and alignment is preserved */
+        if (!footprint_grow(size))
+            return NULL;
+        stats.grow_calls++;
+        if (sbrk(size) == (void *) -1) {
+            stats.footprint -= size;
+            fprintf(stderr, "req_memory failed: ran out of memory\n");
+            errno = ENOMEM;
+            return NULL;
+        }
+        if (thp)
+            madvise(h->top, size, MADV_HUGEPAGE);
+        h->top += size;
+    } else {
+        /* end the heap just short of a grow_step boundary. file backed
+         * heaps grow only as far as asked, since their capacity is the
+         * file's size. */
+        if (grow_step != 0 && h->base == 0)
+            size = ROUNDUP((uintptr_t) h->epilogue + size + WSIZE, grow_step)
+                   - WSIZE - (uintptr_t) h->epilogue;
+        if ((void *) h->epilogue + size + WSIZE > h->top) {
+            // commit whole pages up to the new epilogue in the reservation
+            new_top = (void *) ROUNDUP((uintptr_t) h->epilogue + size + WSIZE,
+                                       page_size);
+            if (new_top > h->limit) {
+                errno = ENOMEM;
+                return NULL;
+            }
+            /* file backed heaps are the caller's memory, not ours, and
+             * they're grown under their own lock, so they keep no stats */
+            if (h->base == 0) {
+                if (!footprint_grow(new_top - h->top))
+                    return NULL;
+                stats.grow_calls++;
+            }
+            if (mprotect(h->top, new_top - h->top,
+                         PROT_READ | PROT_WRITE) < 0) {
+                if (h->base == 0)
+                    stats.footprint -= new_top - h->top;
+                errno = ENOMEM;
+                return NULL;
+            }
+            h->top = new_top;
+        }
     }
     // set and initialize the new block
-    new_block = epilogue;
+    new_block = h->epilogue;
     MARKALLOC(new_block);
+    MARKUNSAMPLED(new_block);
     SETSIZE(new_block, size);
     // set and initialize new epilogue
-    epilogue = (Block *) ((void *) epilogue + size);
-    BOUNDINIT(epilogue);
+    h->epilogue = (Block *) ((void *) h->epilogue + size);
+    BOUNDINIT(h->epilogue);
+    if (h->hp_used != NULL)
+        hp_account(h, new_block, true);
     return new_block;
 }
 
-/* shrink b to the given size and free the remaining space if there's room.
- * requires that size is aligned.
- */
-static void split(Block *b, size_t size) 
+/* heap_map - set h up as a heap in a fresh reservation of address space.
+ * nothing is committed beyond the first page until the heap grows. the
+ * reservation starts on a huge page boundary so thp mode can use it. */
+static int heap_map(Heap *h)
 {
-    size_t new_size;
-    Block *new_block;
+    void *base;
 
-    if ((new_size = SIZE(b) - size) >= MINBLOCK) {
-        // enough room to split
-        SETSIZE(b, size);
-        /* exception to the note that NEXTRAW should only be used for 
-         * coalescing */
-        new_block = NEXTRAW(b);
-        SETSIZE(new_block, new_size);
-        // place the remainder on the unsorted list to reduce fragmentation
-        free_list_insert(new_block, true);
+    if (mapped_count == MAXHEAPS) {
+        errno = ENOMEM;
+        return -1;
+    }
+    stats.grow_calls++;
+    base = mmap(NULL, HEAPRESERVE + HUGEPAGE, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        errno = ENOMEM;
+        return -1;
+    }
+    base = (void *) ROUNDUP((uintptr_t) base, HUGEPAGE);
+    if (mprotect(base, page_size, PROT_READ | PROT_WRITE) < 0) {
+        errno = ENOMEM;
+        return -1;
     }
+    if (thp)
+        madvise(base, HEAPRESERVE, MADV_HUGEPAGE);
+    stats.footprint += page_size;
+    if (stats.footprint > stats.footprint_peak)
+        stats.footprint_peak = stats.footprint;
+    h->top = base + page_size;
+    h->limit = base + HEAPRESERVE;
+    h->prologue = (Block *) base;
+    h->epilogue = (Block *) (base + WSIZE);
+    BOUNDINIT(h->prologue);
+    BOUNDINIT(h->epilogue);
+    if (thp)
+        hp_init(h);
+    // the main heap is found by default rather than by address
+    if (h != &main_heap)
+        mapped_heaps[mapped_count++] = h;
+    return 0;
 }
 
-// find the free list index for a size - unsorted list is index 0
-static inline int find_list_index(size_t s)
+/* start tracking huge page occupancy for h. the table is reserved for the
+ * largest heap and only committed where the heap is. if it can't be
+ * mapped, h is simply placed and purged without regard to huge pages. */
+static void hp_init(Heap *h)
 {
-    int l = 0;
-    if (s < 512)
-        return (s >> 3) - 1;
-    else {
-        s >>= 10;
-        while (s) {
-            l++;
-            s >>= 1;
-        }
-        return l < 12 ? 63 + l : LISTCOUNT - 1;
-    }
+    void *table = mmap(NULL, HPSLOTS * sizeof(uint32_t),
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (table == MAP_FAILED)
+        return;
+    h->hp_used = table;
+    h->hp_base = ROUNDDOWN((uintptr_t) h->prologue, HUGEPAGE);
 }
 
-/* 
- * find a block with block size >= size in list and return it. if no
- * block of sufficient size exists in the list, return NULL. */
-static inline Block *find_in_list(Block *list, size_t size)
+/* count b as used or unused on the huge pages it spans. marking a page
+ * used also clears its released flag, since it's about to be touched. */
+static void hp_account(Heap *h, Block *b, bool used)
 {
-    Block *curr = list;
-    if (size <= MAXSMALL)
-        return list; // for small sizes, just return the head
-    while (curr != NULL) {
-        // for larger sizes, must check the block is big enough
-        if (SIZE(curr) >= size)
-            return curr;
-        curr = curr->next;
+    uintptr_t start = (uintptr_t) b, end = start + SIZE(b), next;
+    size_t i;
+
+    for (; start < end; start = next) {
+        next = ROUNDDOWN(start, HUGEPAGE) + HUGEPAGE;
+        if (next > end)
+            next = end;
+        if ((i = (start - h->hp_base) / HUGEPAGE) >= HPSLOTS)
+            return;
+        if (used)
+            h->hp_used[i] = HPUSED(h->hp_used[i]) + (next - start);
+        else
+            h->hp_used[i] -= next - start;
     }
-    return NULL;
 }
 
-/* search all free lists starting at appropriate idx for a block of at
- * least the given size. blocks are coalesced as they're taken off
- * of the unsorted list */
-static Block *find_block(size_t size)
+/* give back the huge pages that lie entirely inside free block b. only
+ * whole huge pages are released, so the rest of the heap keeps its huge
+ * page mappings. */
+static void hp_release(Heap *h, Block *b)
 {
-    Block *list, *found_block;
-    int list_index;
-
-    /* search the unsorted list first, coalescing blocks and returning them
-     * to the main lists on the way */
-    // TODO could be cleaner probably with a do while
-    found_block = free_lists[0];
-    while (found_block != NULL) {
-        found_block = coalesce(found_block);
-        if (!ISALLOC(found_block)) {
-            free_list_remove(found_block);
-        }
-        if (SIZE(found_block) >= size) {
-            return found_block;
-        }
-        // put block on the main lists
-        free_list_insert(found_block, false);
-        found_block = free_lists[0];
-    }
+    uintptr_t start = ROUNDUP((uintptr_t) b + sizeof(Block) + WSIZE,
+                              HUGEPAGE);
+    uintptr_t end = ROUNDDOWN((uintptr_t) GETFTR(b), HUGEPAGE);
+    size_t i;
 
-    /* search the main lists, starting with the smallest one that
-     * contains big enough blocks */
-    for (list_index = find_list_index(size); list_index < LISTCOUNT; 
-         list_index++) {
-        list = free_lists[list_index];
-        if ((found_block = find_in_list(list, size))) {
-            return found_block; // found a large enough block
-        }
+    for (; start < end; start += HUGEPAGE) {
+        if ((i = (start - h->hp_base) / HUGEPAGE) >= HPSLOTS)
+            return;
+        // the startup reservation stays faulted in
+        if (h->hp_used[i] & HPRELEASED || ((void *) start < reserve_end &&
+                                           (void *) start >= reserve_start))
+            continue;
+        madvise((void *) start, HUGEPAGE, MADV_DONTNEED);
+        h->hp_used[i] |= HPRELEASED;
     }
-    // no block of sufficient size was found
-    return NULL;
 }
 
-/* insert a block into the appropriate address order free list. if unsorted
- * is true, it's put onto the unsorted list instead */
-static void free_list_insert(Block *new_block, bool unsorted)
+/* reserve_heap - grow the main heap by size bytes up front and fault in
+ * every page, locking them in memory if lock is set. the space goes on the
+ * free lists as one block, so nothing up to size bytes of live data needs
+ * another system call. */
+static void reserve_heap(size_t size, bool lock)
 {
-    // get the appropriate list's head
-    Block **head = unsorted ? &free_lists[0] : 
-                              &free_lists[find_list_index(SIZE(new_block))];
-
-    MARKFREE(new_block);
-    MARKUNQUICK(new_block);
-    HDRTOFTR(new_block);
+    Block *b;
+    volatile char *p;
 
-    if (*head == NULL) {
-        *head = new_block;
-        new_block->next = NULL;
-        new_block->prev = NULL;
+    if (size == 0)
+        return;
+    if ((b = extend_heap(&main_heap, ROUNDUP(size, page_size))) == NULL) {
+        fprintf(stderr, "malloc_init: couldn't reserve %zu bytes\n", size);
         return;
     }
-    new_block->next = *head;
-    (*head)->prev = new_block;
-    *head = new_block;
-    new_block->prev = NULL;
+    reserve_start = b;
+    reserve_end = NEXTRAW(b);
+    stats.reserved = SIZE(b);
+
+#ifdef MADV_POPULATE_WRITE
+    if (madvise((void *) ROUNDDOWN((uintptr_t) b, page_size),
+                (uintptr_t) reserve_end - ROUNDDOWN((uintptr_t) b, page_size),
+                MADV_POPULATE_WRITE) < 0)
+#endif
+    {
+        // older kernels - write to every page by hand
+        for (p = reserve_start; (void *) p < reserve_end; p += page_size)
+            *p = *p;
+    }
+    if (lock && mlock(reserve_start, SIZE(b)) < 0)
+        fprintf(stderr, "malloc_init: couldn't lock reserved heap\n");
+    free_list_insert(&main_heap, b, false);
 }
 
-/* remove b from the global free list and mark it as allocated and
- * uncoalescable
- * 
- * note: it only matters what free list b is on if b is the head of that
- * list. the only two lists it can be on are the unsorted list and the
+/* take a free main heap block for a request of size bytes, without
+ * growing the heap. returns NULL if none fits. */
+static void *reserve_alloc(size_t size)
+{
+    Block *b;
+
+    if (size > ALIGN(BLOCKSIZE(size)))
+        return NULL;
+    size = ALIGN(BLOCKSIZE(size));
+    if ((b = find_block(&main_heap, size)) == NULL)
+        return NULL;
+    if (!ISALLOC(b))
+        free_list_remove(&main_heap, b);
+    split(&main_heap, b, size);
+    if ((void *) b < reserve_start || (void *) b >= reserve_end)
+        stats.outside_reserve++;
+    return BLOCKTOUSER(b);
+}
+
+/* ma_get_stats - copy the allocator's counters into st */
+void ma_get_stats(struct ma_stats *st)
+{
+    int i;
+
+    pthread_mutex_lock(&heap_lock);
+    *st = stats;
+    pthread_mutex_unlock(&heap_lock);
+    for (i = 0; i < MA_TAGS; i++)
+        st->tag_bytes[i] = atomic_load_explicit(&tag_bytes[i],
+                                                memory_order_relaxed);
+}
+
+/* find the process heap a block belongs to, or NULL if it's in none of
+ * them - persistent heaps and other allocators' memory included */
+static Heap *heap_of(Block *b)
+{
+    int i;
+
+    for (i = 0; i < mapped_count; i++) {
+        if ((void *) b > (void *) mapped_heaps[i]->prologue &&
+            (void *) b < mapped_heaps[i]->limit)
+            return mapped_heaps[i];
+    }
+    if ((void *) b > (void *) main_heap.prologue &&
+        (void *) b < (void *) main_heap.epilogue)
+        return &main_heap;
+    return NULL;
+}
+
+/* pick the heap for an allocation from the malloc call site - long lived
+ * sites get their own heap when lifetime segregation is on */
+static Heap *choose_heap(void *caller)
+{
+    Site *site;
+    uintptr_t addr = (uintptr_t) caller;
+
+    if (!segregate && !profile_lifetime)
+        return &main_heap;
+
+    alloc_clock++;
+    site = &sites[(addr ^ (addr >> 12)) * 0x9E3779B97F4A7C15ULL >> 54];
+    if (site->addr != addr) {
+        // slot belonged to another site - start learning from scratch
+        memset(site, 0, sizeof(Site));
+        site->addr = addr;
+    }
+    curr_site = site;
+    if (segregate && site->samples >= SITEMINSAMPLES &&
+        site->lifetime >= long_lived) {
+        if (long_heap.limit != NULL || heap_map(&long_heap) == 0)
+            return &long_heap;
+    }
+    return &main_heap;
+}
+
+// fold one observed lifetime into a site's moving average
+static void site_learn(Site *site, uint64_t lifetime)
+{
+    if (site->samples++ == 0)
+        site->lifetime = lifetime;
+    else
+        site->lifetime = site->lifetime - site->lifetime / 8 + lifetime / 8;
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// histogram bucket for an age in nanoseconds
+static inline int age_bucket(uint64_t ns)
+{
+    int i = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    return i < AGEBUCKETS ? i : AGEBUCKETS - 1;
+}
+
+static inline Sample *sample_slot(Block *b)
+{
+    return &samples[((uintptr_t) b >> 4) * 0x9E3779B97F4A7C15ULL >> 52];
+}
+
+/* start watching a newly allocated block. if another live sample holds the
+ * slot, it's dropped - but if it has already lived long enough to count as
+ * long lived, its site learns that first. */
+static void sample_alloc(Block *b)
+{
+    Sample *s = sample_slot(b);
+
+    if (s->block != NULL) {
+        if (alloc_clock - s->born >= long_lived)
+            site_learn(s->site, alloc_clock - s->born);
+        if (profile_lifetime) {
+            s->site->survivors++;
+            class_survivors[s->list]++;
+        }
+        MARKUNSAMPLED(s->block);
+    }
+    s->block = b;
+    s->site = curr_site;
+    s->born = alloc_clock;
+    if (profile_lifetime) {
+        s->born_ns = now_ns();
+        s->list = find_list_index(SIZE(b));
+    }
+    MARKSAMPLED(b);
+}
+
+/* stop watching b. if learn is set, b is being freed and its lifetime is
+ * taught to the site that allocated it. */
+static void sample_free(Block *b, bool learn)
+{
+    Sample *s = sample_slot(b);
+
+    int bucket;
+
+    if (s->block == b) {
+        if (learn)
+            site_learn(s->site, alloc_clock - s->born);
+        if (learn && profile_lifetime) {
+            bucket = age_bucket(now_ns() - s->born_ns);
+            s->site->ages[bucket]++;
+            class_ages[s->list][bucket]++;
+        }
+        s->block = NULL;
+    }
+    MARKUNSAMPLED(b);
+}
+
+// smallest block size kept on a free list
+static size_t list_floor(int list)
+{
+#ifdef MA_CLASS_TABLE
+    return list < CLASSLISTS ? class_floor[list] :
+                               CLASSLIMIT << (list - CLASSLISTS);
+#else
+    return list < 63 ? (size_t) (list + 1) << 3 : (size_t) 512 << (list - 63);
+#endif
+}
+
+/* age below which the given fraction of a histogram's samples fall, as
+ * the upper bound of the bucket it lands in */
+static uint64_t age_quantile(const uint32_t *ages, uint32_t total, double q)
+{
+    uint32_t seen = 0;
+    int i;
+
+    for (i = 0; i < AGEBUCKETS; i++) {
+        seen += ages[i];
+        if (seen > 0 && seen >= q * total)
+            return (uint64_t) 1 << i;
+    }
+    return (uint64_t) 1 << (AGEBUCKETS - 1);
+}
+
+/* print the median and 90th percentile of a histogram with readable
+ * units, or dashes if it's empty */
+static void print_ages(FILE *out, const uint32_t *ages, uint32_t total)
+{
+    if (total == 0) {
+        fprintf(out, "%8s %8s", "-", "-");
+        return;
+    }
+    print_age(out, age_quantile(ages, total, 0.5));
+    fprintf(out, " ");
+    print_age(out, age_quantile(ages, total, 0.9));
+}
+
+// print a nanosecond age with a readable unit
+static void print_age(FILE *out, uint64_t ns)
+{
+    if (ns < 1000)
+        fprintf(out, "%6lluns", (unsigned long long) ns);
+    else if (ns < 1000000)
+        fprintf(out, "%6lluus", (unsigned long long) ns / 1000);
+    else if (ns < 1000000000)
+        fprintf(out, "%6llums", (unsigned long long) ns / 1000000);
+    else
+        fprintf(out, "%6llus ", (unsigned long long) ns / 1000000000);
+}
+
+static uint32_t sum_ages(const uint32_t *ages)
+{
+    uint32_t total = 0;
+    int i;
+
+    for (i = 0; i < AGEBUCKETS; i++)
+        total += ages[i];
+    return total;
+}
+
+/* ma_lifetime_report - print the ages of freed samples per size class and
+ * per call site. sites whose objects are nearly all freed within
+ * MICROALLOC_SHORT_LIVED_US are flagged as region candidates; sites whose
+ * samples are mostly still live are flagged as immortal. */
+void ma_lifetime_report(FILE *out)
+{
+    /* the tables are copied under heap_lock and printed from the copies,
+     * since printing may allocate */
+    static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+    static uint32_t site_live[SITESLOTS], list_live[LISTCOUNT];
+    static Site sites_copy[SITESLOTS];
+    static uint32_t ages_copy[LISTCOUNT][AGEBUCKETS];
+    static uint32_t survivors_copy[LISTCOUNT];
+    uint32_t freed, live;
+    Site *site;
+    Dl_info info;
+    int i;
+
+    if (!profile_lifetime) {
+        fprintf(out, "lifetime profiling is off - set "
+                     "MICROALLOC_PROFILE_LIFETIME=1\n");
+        return;
+    }
+
+    pthread_mutex_lock(&report_lock);
+    pthread_mutex_lock(&heap_lock);
+    // samples still in the table are live, as are ones that were dropped
+    memset(site_live, 0, sizeof(site_live));
+    memset(list_live, 0, sizeof(list_live));
+    for (i = 0; i < SAMPLESLOTS; i++) {
+        if (samples[i].block != NULL) {
+            site_live[samples[i].site - sites]++;
+            list_live[samples[i].list]++;
+        }
+    }
+    memcpy(sites_copy, sites, sizeof(sites));
+    memcpy(ages_copy, class_ages, sizeof(class_ages));
+    memcpy(survivors_copy, class_survivors, sizeof(class_survivors));
+    pthread_mutex_unlock(&heap_lock);
+
+    fprintf(out, "%-10s %10s %10s %8s %8s\n", "class", "freed", "live",
+            "median", "p90");
+    for (i = 0; i < LISTCOUNT; i++) {
+        freed = sum_ages(ages_copy[i]);
+        live = list_live[i] + survivors_copy[i];
+        if (freed + live == 0)
+            continue;
+        fprintf(out, "%s%-8zu %10u %10u ", i < 63 ? "  " : ">=",
+                list_floor(i), freed, live);
+        print_ages(out, ages_copy[i], freed);
+        fprintf(out, "\n");
+    }
+
+    fprintf(out, "\n%-18s %10s %10s %8s %8s  %s\n", "site", "freed", "live",
+            "median", "p90", "verdict");
+    for (i = 0; i < SITESLOTS; i++) {
+        site = &sites_copy[i];
+        freed = sum_ages(site->ages);
+        live = site_live[i] + site->survivors;
+        if (freed + live == 0)
+            continue;
+        fprintf(out, "%#-18lx %10u %10u ", (unsigned long) site->addr, freed,
+                live);
+        print_ages(out, site->ages, freed);
+        if (live * 4 >= (freed + live) * 3)
+            fprintf(out, "  immortal");
+        else if (freed >= 8 && age_quantile(site->ages, freed, 0.9) <=
+                 (uint64_t) short_lived_us * 1000)
+            fprintf(out, "  short lived - region candidate");
+        else
+            fprintf(out, "  -");
+        // name the site by symbol if there is one, otherwise by object
+        if (dladdr((void *) site->addr, &info) && info.dli_sname != NULL)
+            fprintf(out, " (%s+%#lx)", info.dli_sname,
+                    (unsigned long) (site->addr - (uintptr_t) info.dli_saddr));
+        else if (info.dli_fname != NULL)
+            fprintf(out, " (%s+%#lx)", info.dli_fname,
+                    (unsigned long) (site->addr - (uintptr_t) info.dli_fbase));
+        fprintf(out, "\n");
+    }
+    pthread_mutex_unlock(&report_lock);
+}
+
+// print the lifetime profile when the program exits
+static void lifetime_exit(void)
+{
+    if (profile_lifetime)
+        ma_lifetime_report(stderr);
+}
+
+/* shrink b to the given size and free the remaining space if there's room.
+ * requires that size is aligned.
+ */
+static void split(Heap *h, Block *b, size_t size) 
+{
+    size_t new_size;
+    Block *new_block;
+
+    if ((new_size = SIZE(b) - size) >= split_min) {
+        // enough room to split
+        SETSIZE(b, size);
+        /* exception to the note that NEXTRAW should only be used for 
+         * coalescing */
+        new_block = NEXTRAW(b);
+        SETSIZE(new_block, new_size);
+        // place the remainder on the unsorted list to reduce fragmentation
+        free_list_insert(h, new_block, true);
+    }
+}
+
+// find the free list index for a size - unsorted list is index 0
+static inline int find_list_index(size_t s)
+{
+#ifdef MA_CLASS_TABLE
+    /* sizes past the table read its last entry, the first power of two
+     * list, and add how many times they've doubled since CLASSLIMIT */
+    size_t i = class_table[(s < CLASSLIMIT ? s : CLASSLIMIT) >> 3] + 63 -
+               __builtin_clzll((s >> CLASSSHIFT) | 1);
+
+    return i < LISTCOUNT ? i : LISTCOUNT - 1;
+#else
+    int l = 0;
+    if (s < 512)
+        return (s >> 3) - 1;
+    else {
+        s >>= 10;
+        while (s) {
+            l++;
+            s >>= 1;
+        }
+        return l < 12 ? 63 + l : LISTCOUNT - 1;
+    }
+#endif
+}
+
+/* 
+ * find a block with block size >= size in list and return it. if no
+ * block of sufficient size exists in the list, return NULL. */
+static inline Block *find_in_list(Heap *h, Block *list, size_t size)
+{
+    Block *curr = list;
+#ifndef MA_CLASS_TABLE
+    if (size <= MAXSMALL)
+        return list; // for small sizes, just return the head
+#endif
+    while (curr != NULL) {
+        // for larger sizes, must check the block is big enough
+        if (SIZE(curr) >= size)
+            return curr;
+        curr = NEXT(h, curr);
+    }
+    return NULL;
+}
+
+/* like find_in_list, but compare the first few blocks that fit and take
+ * the one on the fullest huge page, so sparse huge pages can drain and be
+ * released */
+static Block *find_dense(Heap *h, Block *list, size_t size)
+{
+    Block *curr, *best = NULL;
+    uint32_t used, best_used = 0;
+    size_t i;
+    int seen = 0;
+
+    for (curr = list; curr != NULL && seen < HPSCAN;
+         curr = NEXT(h, curr)) {
+        if (SIZE(curr) < size)
+            continue;
+        i = ((uintptr_t) curr - h->hp_base) / HUGEPAGE;
+        used = i < HPSLOTS ? HPUSED(h->hp_used[i]) : 0;
+        if (best == NULL || used > best_used) {
+            best = curr;
+            best_used = used;
+        }
+        seen++;
+    }
+    return best;
+}
+
+/* search all free lists starting at appropriate idx for a block of at
+ * least the given size. blocks are coalesced as they're taken off
+ * of the unsorted list */
+static Block *find_block(Heap *h, size_t size)
+{
+    Block *list, *found_block;
+    int list_index;
+    size_t drained = 0;
+
+    /* search the unsorted list first, coalescing blocks and returning them
+     * to the main lists on the way - at most unsorted_cap of them, so the
+     * cost of a call stays bounded when the maintenance thread drains. it
+     * never sees file backed and shared heaps, so theirs is drained whole.
+     * in thp mode every block is sorted, so find_dense gets to pick the
+     * one on the fullest huge page. */
+    // TODO could be cleaner probably with a do while
+    found_block = HEAD(h, 0);
+    while (found_block != NULL &&
+           (drained++ < unsorted_cap || h->base != 0)) {
+        found_block = coalesce(h, found_block);
+        if (!ISALLOC(found_block)) {
+            free_list_remove(h, found_block);
+        }
+        if (SIZE(found_block) >= size && h->hp_used == NULL) {
+            return found_block;
+        }
+        // put block on the main lists
+        free_list_insert(h, found_block, false);
+        found_block = HEAD(h, 0);
+    }
+
+    /* search the main lists, starting with the smallest one that
+     * contains big enough blocks */
+    for (list_index = find_list_index(size); list_index < LISTCOUNT; 
+         list_index++) {
+        list = HEAD(h, list_index);
+        found_block = h->hp_used != NULL ? find_dense(h, list, size) :
+                                           find_in_list(h, list, size);
+        if (found_block != NULL) {
+            return found_block; // found a large enough block
+        }
+    }
+    // no block of sufficient size was found
+    return NULL;
+}
+
+/* find a free block of at least size bytes near b in the address space,
+ * without searching the free lists. the raw neighbors of b are checked
+ * first, then the rest of the page b starts in. returns NULL if nothing
+ * nearby is big enough. */
+static Block *find_near(Block *b, size_t size)
+{
+    Block *curr;
+    uintptr_t page_start = (uintptr_t) b & ~(page_size - 1);
+    uintptr_t page_end = page_start + page_size;
+
+    // immediate neighbors share a cache line with b
+    if (!NEXTUNCOAL(b) && SIZE(NEXTRAW(b)) >= size)
+        return NEXTRAW(b);
+    if (!PREVUNCOAL(b) && SIZE(PREVRAW(b)) >= size)
+        return PREVRAW(b);
+
+    // walk forward to the end of the page
+    for (curr = NEXTRAW(b); (uintptr_t) curr < page_end && SIZE(curr) != 0;
+         curr = NEXTRAW(curr)) {
+        if (!(curr->size & 0x3) && SIZE(curr) >= size)
+            return curr;
+    }
+    /* walk backward to the start of the page - a footer of size 0 is the
+     * prologue */
+    for (curr = b; SIZE(PREVFTR(curr)) != 0; ) {
+        curr = PREVRAW(curr);
+        if ((uintptr_t) curr < page_start)
+            break;
+        if (!(curr->size & 0x3) && SIZE(curr) >= size)
+            return curr;
+    }
+    return NULL;
+}
+
+/* insert a block into the appropriate address order free list. if unsorted
+ * is true, it's put onto the unsorted list instead */
+static void free_list_insert(Heap *h, Block *new_block, bool unsorted)
+{
+    // get the appropriate list's head
+    uintptr_t *head = unsorted ? &h->free_lists[0] :
+                          &h->free_lists[find_list_index(SIZE(new_block))];
+    Block *prev, *next;
+
+    MARKFREE(new_block);
+    MARKUNQUICK(new_block);
+    MARKUNSAMPLED(new_block);
+    if (SIZE(new_block) >= 2 * page_size)
+        FREEPASS(new_block) = bg_pass;
+    if (h->hp_used != NULL)
+        hp_account(h, new_block, false);
+    HDRTOFTR(new_block);
+
+    if (*head == 0) {
+        *head = TOLINK(h, new_block);
+        new_block->next = 0;
+        new_block->prev = 0;
+        return;
+    }
+    if (addr_order && !unsorted) {
+        for (prev = NULL, next = TOBLOCK(h, *head);
+             next != NULL && next < new_block; next = NEXT(h, next))
+            prev = next;
+        new_block->prev = TOLINK(h, prev);
+        new_block->next = TOLINK(h, next);
+        if (prev != NULL)
+            prev->next = TOLINK(h, new_block);
+        else
+            *head = TOLINK(h, new_block);
+        if (next != NULL)
+            next->prev = TOLINK(h, new_block);
+        return;
+    }
+    new_block->next = *head;
+    TOBLOCK(h, *head)->prev = TOLINK(h, new_block);
+    *head = TOLINK(h, new_block);
+    new_block->prev = 0;
+}
+
+/* remove b from the global free list and mark it as allocated and
+ * uncoalescable
+ * 
+ * note: it only matters what free list b is on if b is the head of that
+ * list. the only two lists it can be on are the unsorted list and the
  * appropriate list for its size, so if it's not the head of either of
  * those, than it can be treated as if it's on either
  */
-static void free_list_remove(Block *b)
+static void free_list_remove(Heap *h, Block *b)
 {
-    Block **size_head = &free_lists[find_list_index(SIZE(b))];
-    Block **unsorted_head = &free_lists[0];
-    Block **head;
+    uintptr_t *size_head = &h->free_lists[find_list_index(SIZE(b))];
+    uintptr_t *unsorted_head = &h->free_lists[0];
+    uintptr_t *head, link = TOLINK(h, b);
 
     // if b is the head of its list, update the head
-    if (b == *size_head || b == *unsorted_head) {
-        head = b == *size_head ? size_head : unsorted_head;
+    if (link == *size_head || link == *unsorted_head) {
+        head = link == *size_head ? size_head : unsorted_head;
         *head = b->next;
-        if (*head != NULL)
-            (*head)->prev = NULL;
+        if (*head != 0)
+            TOBLOCK(h, *head)->prev = 0;
     } else {
         // if b isn't the head, it must have a previous block
-        b->prev->next = b->next;
+        PREV(h, b)->next = b->next;
     }
-    if (b->next != NULL)
-        b->next->prev = b->prev;
+    if (b->next != 0)
+        NEXT(h, b)->prev = b->prev;
+    if (h->base == 0 && b == bg_cursor)
+        bg_cursor = NULL;
     MARKALLOC(b);
     HDRTOFTR(b);
+    if (h->hp_used != NULL)
+        hp_account(h, b, true);
 }
 
-// coalesce b with its immediate neighbors if possible
-static Block *coalesce(Block *b)
+// coalesce b with its immediate neighbors in heap h if possible
+static Block *coalesce(Heap *h, Block *b)
 {
     Block *prev, *next, *local_block;
     size_t new_size = SIZE(b);
@@ -548,21 +2046,2353 @@ static Block *coalesce(Block *b)
     // and update the new block size if they're coalescable
     if (!PREVUNCOAL(b)) {
         prev = PREVRAW(b);
-        free_list_remove(prev);
+        free_list_remove(h, prev);
         new_size += SIZE(prev);
         // prev block is now the start of the new block
         local_block = prev;
     }
     if (!NEXTUNCOAL(b)) {
         next = NEXTRAW(b);
-        free_list_remove(next);
+        free_list_remove(h, next);
         new_size += SIZE(next);
     }
     if (new_size != SIZE(b)) {
         // coalescing is possible
         if (!ISALLOC(b))
-            free_list_remove(b);
+            free_list_remove(h, b);
         SETSIZE(local_block, new_size);
     }
     return local_block;
 }
+
+/* purge_block - give the whole pages inside free block b back to the
+ * system. in thp mode only whole huge pages are given back. the
+ * startup reservation is never purged. */
+static void purge_block(Heap *h, Block *b)
+{
+    uintptr_t start = ROUNDUP((uintptr_t) b + sizeof(Block) + WSIZE,
+                              page_size);
+    uintptr_t end = ROUNDDOWN((uintptr_t) GETFTR(b), page_size);
+
+    MARKPURGED(b);
+    if (h->hp_used != NULL) {
+        hp_release(h, b);
+        return;
+    }
+    if ((void *) start < reserve_end && (void *) end > reserve_start)
+        return;
+    if (start < end)
+        madvise((void *) start, end - start, MADV_DONTNEED);
+}
+
+/* trim_heap - if the last block in h is free and bigger than the trim
+ * threshold, hand it back to the system, keeping the end of the heap on a
+ * page or grow_step boundary */
+static void trim_heap(Heap *h)
+{
+    Block *last = PREVRAW(h->epilogue);
+    size_t step = grow_step > page_size ? grow_step : page_size;
+    void *new_top;
+
+    if (ISALLOC(last) || ISQUICK(last) || SIZE(last) < trim_threshold)
+        return;
+    /* a thread popping a quick list may still read the link of a block
+     * that's just been taken off it and freed, so nothing is unmapped
+     * while a pop is under way. the next trim gets it. */
+    if (quick_on && atomic_load(&quick_poppers) != 0)
+        return;
+    if ((void *) last < reserve_end && (void *) h->epilogue > reserve_start)
+        return;
+    new_top = (void *) ROUNDUP((uintptr_t) last + WSIZE, step);
+    if (new_top >= h->top)
+        return;
+    // something else moved the break - the space isn't ours to give
+    if (h->limit == NULL && sbrk(0) != h->top)
+        return;
+    // take the block off its list while its footer is still mapped
+    free_list_remove(h, last);
+    if (h->limit == NULL) {
+        if (sbrk(new_top - h->top) == (void *) -1) {
+            free_list_insert(h, last, false);
+            return;
+        }
+    } else {
+        madvise(new_top, h->top - new_top, MADV_DONTNEED);
+        mprotect(new_top, h->top - new_top, PROT_NONE);
+    }
+    if (h->hp_used != NULL)
+        hp_account(h, last, false);
+    stats.footprint -= h->top - new_top;
+    h->top = new_top;
+    h->epilogue = last;
+    BOUNDINIT(h->epilogue);
+}
+
+/* maintain_heap - one maintenance pass over h. heap_lock is taken for at
+ * most BGBATCH blocks or BGPURGES purges at a time, so application
+ * threads never wait long behind the maintenance thread. */
+static void maintain_heap(Heap *h)
+{
+    Block *b;
+    int list_index, n, purged;
+
+    /* purge blocks that were already on the main lists last pass. each
+     * hold of the lock picks up where the last one stopped, and if that
+     * block was taken meanwhile, the rest of the list waits for the next
+     * pass rather than being walked again from the start. */
+    for (list_index = find_list_index(2 * page_size);
+         list_index < LISTCOUNT; list_index++) {
+        pthread_mutex_lock(&heap_lock);
+        b = HEAD(h, list_index);
+        for (;;) {
+            for (n = purged = 0; b != NULL && n < BGBATCH &&
+                 purged < BGPURGES; b = NEXT(h, b), n++) {
+                if (!ISPURGED(b) && SIZE(b) >= 2 * page_size &&
+                    FREEPASS(b) < bg_pass) {
+                    purge_block(h, b);
+                    purged++;
+                }
+            }
+            bg_cursor = b;
+            pthread_mutex_unlock(&heap_lock);
+            if (b == NULL)
+                break;
+            pthread_mutex_lock(&heap_lock);
+            if (bg_cursor != b) {
+                pthread_mutex_unlock(&heap_lock);
+                break;
+            }
+        }
+    }
+
+    // drain the unsorted list, coalescing on the way to the main lists
+    do {
+        pthread_mutex_lock(&heap_lock);
+        for (n = 0; n < BGBATCH && (b = HEAD(h, 0)) != NULL; n++) {
+            b = coalesce(h, b);
+            if (!ISALLOC(b))
+                free_list_remove(h, b);
+            free_list_insert(h, b, false);
+        }
+        pthread_mutex_unlock(&heap_lock);
+    } while (n == BGBATCH);
+
+    pthread_mutex_lock(&heap_lock);
+    trim_heap(h);
+    pthread_mutex_unlock(&heap_lock);
+}
+
+// body of the maintenance thread
+static void *maintenance(void *arg)
+{
+    struct timespec interval;
+    int i, count;
+
+    interval.tv_sec = bg_interval_ms / 1000;
+    interval.tv_nsec = (bg_interval_ms % 1000) * 1000000;
+    for (;;) {
+        nanosleep(&interval, NULL);
+        pthread_mutex_lock(&heap_lock);
+        bg_pass++;
+        count = mapped_count;
+        if (quick_on)
+            quick_flush();
+        pthread_mutex_unlock(&heap_lock);
+        if (tcache_bytes != 0)
+            tcache_gc();
+
+        maintain_heap(&main_heap);
+        // mapped heaps are never unmapped, so they're safe to walk
+        for (i = 0; i < count; i++)
+            maintain_heap(mapped_heaps[i]);
+    }
+    return arg;
+}
+
+/* start the maintenance thread if MICROALLOC_BG_INTERVAL_MS is set. this
+ * runs as a constructor rather than from malloc_init, since creating a
+ * thread allocates and can't happen inside the first call to malloc. */
+static void maintenance_start(void)
+{
+    int err;
+
+    pthread_mutex_lock(&heap_lock);
+    err = malloc_init();
+    pthread_mutex_unlock(&heap_lock);
+    if (err < 0)
+        return;
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+    maintenance_spawn();
+}
+
+// start the maintenance thread if one is wanted
+static void maintenance_spawn(void)
+{
+    pthread_t thread;
+
+    if (bg_interval_ms == 0)
+        return;
+    if (pthread_create(&thread, NULL, maintenance, NULL) != 0) {
+        fprintf(stderr, "microalloc: couldn't start maintenance thread\n");
+        // fall back to coalescing inline
+        bg_interval_ms = 0;
+        return;
+    }
+    pthread_detach(thread);
+}
+
+/* ma_free_async - free ptr on the helper thread. the caller only stores
+ * the pointer in its ring; if the ring is full or the helper couldn't be
+ * started, ptr is freed right away. */
+void ma_free_async(void *ptr)
+{
+    FreeRing *ring;
+
+    if (ptr == NULL)
+        return;
+    if ((ring = ring_get()) == NULL || !ring_push(ring, ptr))
+        free(ptr);
+}
+
+/* ma_async_free_mode - make every free on the calling thread behave like
+ * ma_free_async if on is nonzero, or go back to freeing synchronously */
+void ma_async_free_mode(int on)
+{
+    async_free = on && ring_get() != NULL;
+}
+
+/* ma_async_flush - wait until the helper has freed everything the calling
+ * thread queued */
+void ma_async_flush(void)
+{
+    FreeRing *ring = my_ring;
+
+    if (ring == NULL)
+        return;
+    while (atomic_load_explicit(&ring->head, memory_order_acquire) !=
+           atomic_load_explicit(&ring->tail, memory_order_relaxed))
+        sched_yield();
+}
+
+// hand a thread's ring over to the helper when the thread exits
+static void ring_orphan(void *ring)
+{
+    // frees from later tls destructors go straight to the heap
+    my_ring = NULL;
+    async_free = false;
+    atomic_store_explicit(&((FreeRing *) ring)->orphaned, true,
+                          memory_order_release);
+}
+
+static void ring_key_create(void)
+{
+    pthread_key_create(&ring_key, ring_orphan);
+}
+
+/* start the helper thread - called with rings_lock held. what
+ * pthread_create allocates belongs to the allocator, not to the tag of
+ * the thread that happened to start it. */
+static bool helper_spawn(void)
+{
+    pthread_t thread;
+    unsigned tag = my_tag;
+    int err;
+
+    my_tag = 0;
+    err = pthread_create(&thread, NULL, free_helper, NULL);
+    my_tag = tag;
+    if (err != 0)
+        return false;
+    pthread_detach(thread);
+    helper_started = true;
+    return true;
+}
+
+/* get the calling thread's ring, creating it and the helper thread on
+ * first use. returns NULL if either couldn't be created. rings are mapped
+ * directly rather than malloc'd so the helper can drain them after their
+ * threads are gone. */
+static FreeRing *ring_get(void)
+{
+    FreeRing *ring;
+
+    if (my_ring != NULL)
+        return my_ring;
+
+    pthread_once(&ring_key_once, ring_key_create);
+    pthread_mutex_lock(&rings_lock);
+    if (!helper_started && !helper_spawn()) {
+        pthread_mutex_unlock(&rings_lock);
+        return NULL;
+    }
+    ring = mmap(NULL, sizeof(FreeRing), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        pthread_mutex_unlock(&rings_lock);
+        return NULL;
+    }
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_lock);
+
+    pthread_setspecific(ring_key, ring);
+    my_ring = ring;
+    return ring;
+}
+
+// queue ptr on ring - returns false if the ring is full
+static inline bool ring_push(FreeRing *ring, void *ptr)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    if (tail - ring->cached_head == RINGSIZE) {
+        ring->cached_head = atomic_load_explicit(&ring->head,
+                                                 memory_order_acquire);
+        if (tail - ring->cached_head == RINGSIZE)
+            return false;
+    }
+    ring->slots[tail % RINGSIZE] = ptr;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+/* free up to BGBATCH pointers from ring under one hold of heap_lock.
+ * returns the number freed. */
+static size_t ring_drain(FreeRing *ring)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t n;
+
+    if (tail - head > BGBATCH)
+        tail = head + BGBATCH;
+    if (head == tail)
+        return 0;
+    pthread_mutex_lock(&heap_lock);
+    for (n = head; n != tail; n++)
+        free_block(USERTOBLOCK(ring->slots[n % RINGSIZE]));
+    // under the lock, so a fork never sees freed pointers still queued
+    atomic_store_explicit(&ring->head, tail, memory_order_release);
+    pthread_mutex_unlock(&heap_lock);
+    return tail - head;
+}
+
+/* body of the helper thread - sweep every ring, freeing what's queued,
+ * and back off to sleeping up to a millisecond at a time when idle */
+static void *free_helper(void *arg)
+{
+    FreeRing *ring, **link;
+    struct timespec nap = {0, 0};
+    size_t freed;
+    bool dead;
+
+    for (;;) {
+        freed = 0;
+        pthread_mutex_lock(&rings_lock);
+        for (link = &rings; (ring = *link) != NULL; ) {
+            // check orphaned first so nothing pushed before exit is missed
+            dead = atomic_load_explicit(&ring->orphaned,
+                                        memory_order_acquire);
+            freed += ring_drain(ring);
+            if (dead && atomic_load_explicit(&ring->head,
+                                             memory_order_relaxed) ==
+                        atomic_load_explicit(&ring->tail,
+                                             memory_order_relaxed)) {
+                *link = ring->next;
+                munmap(ring, sizeof(FreeRing));
+            } else {
+                link = &ring->next;
+            }
+        }
+        pthread_mutex_unlock(&rings_lock);
+
+        if (freed == 0) {
+            nap.tv_nsec = nap.tv_nsec == 0 ? 50000 :
+                          nap.tv_nsec < 1000000 ? nap.tv_nsec * 2 : 1000000;
+            nanosleep(&nap, NULL);
+        } else {
+            nap.tv_nsec = 0;
+        }
+    }
+    return arg;
+}
+
+/* ma_epoch_enter - start a critical section in which pointers read from
+ * shared structures stay valid even if another thread retires them.
+ * sections can nest. */
+void ma_epoch_enter(void)
+{
+    EpochRec *rec = epoch_rec_get();
+
+    if (rec == NULL || rec->nesting++ > 0)
+        return;
+    atomic_store_explicit(&rec->state,
+                          atomic_load(&global_epoch) << 1 | 1,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+// ma_epoch_exit - end the critical section started by ma_epoch_enter
+void ma_epoch_exit(void)
+{
+    EpochRec *rec = my_epoch_rec;
+
+    if (rec == NULL || rec->nesting == 0 || --rec->nesting > 0)
+        return;
+    atomic_store_explicit(&rec->state, 0, memory_order_release);
+}
+
+/* ma_retire - free ptr once no thread can be in a critical section that
+ * saw it. */
+void ma_retire(void *ptr)
+{
+    EpochRec *rec;
+    BagChunk *chunk;
+    size_t e, i;
+
+    if (ptr == NULL)
+        return;
+    if ((rec = epoch_rec_get()) == NULL) {
+        // freeing now could break a reader - leak instead
+        fprintf(stderr, "ma_retire: couldn't register thread\n");
+        return;
+    }
+    e = atomic_load(&global_epoch);
+    i = e % 3;
+    // a bag from three or more epochs ago is safe to free
+    if (rec->bags[i] != NULL && rec->bag_epoch[i] != e)
+        bag_free(rec, i);
+    rec->bag_epoch[i] = e;
+    chunk = rec->bags[i];
+    if (chunk == NULL || chunk->count == BAGSLOTS) {
+        if ((chunk = rec->spare) != NULL)
+            rec->spare = chunk->next;
+        else if ((chunk = mmap(NULL, BAGCHUNK, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0))
+                 == MAP_FAILED) {
+            fprintf(stderr, "ma_retire: couldn't map a bag\n");
+            return;
+        }
+        chunk->next = rec->bags[i];
+        chunk->count = 0;
+        atomic_thread_fence(memory_order_release);
+        rec->bags[i] = chunk;
+    }
+    /* another thread may fork at any point, and the child frees this bag
+     * once the record is released. a slot is only counted once it's
+     * written and a chunk only linked once it's emptied, so the child
+     * never frees a stale pointer left in a reused chunk. */
+    chunk->ptrs[chunk->count] = ptr;
+    atomic_thread_fence(memory_order_release);
+    chunk->count++;
+    if (++rec->retired % EPOCHBATCH == 0)
+        epoch_advance();
+}
+
+/* ma_epoch_reclaim - try to advance the epoch and free every pointer the
+ * calling thread retired that is now safe. retired pointers are otherwise
+ * only freed as the thread retires more. */
+void ma_epoch_reclaim(void)
+{
+    EpochRec *rec = my_epoch_rec;
+    size_t e, i;
+
+    if (rec == NULL)
+        return;
+    epoch_advance();
+    e = atomic_load(&global_epoch);
+    for (i = 0; i < 3; i++) {
+        if (rec->bags[i] != NULL && rec->bag_epoch[i] + 2 <= e)
+            bag_free(rec, i);
+    }
+}
+
+/* free one of a record's bags under a single hold of heap_lock and keep
+ * its chunks for reuse */
+static void bag_free(EpochRec *rec, int i)
+{
+    BagChunk *chunk, *next;
+    size_t j;
+
+    pthread_mutex_lock(&heap_lock);
+    for (chunk = rec->bags[i]; chunk != NULL; chunk = next) {
+        for (j = 0; j < chunk->count; j++)
+            free_block(USERTOBLOCK(chunk->ptrs[j]));
+        next = chunk->next;
+        chunk->next = rec->spare;
+        rec->spare = chunk;
+    }
+    // emptied under the lock, so a fork never sees freed pointers in it
+    rec->bags[i] = NULL;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/* advance the global epoch if every thread in a critical section has seen
+ * the current one. on success, the bags that exited threads left behind
+ * are freed once they're old enough. */
+static void epoch_advance(void)
+{
+    size_t e = atomic_load(&global_epoch), state, i;
+    EpochRec *rec;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    for (rec = atomic_load(&epoch_recs); rec != NULL; rec = rec->next) {
+        state = atomic_load_explicit(&rec->state, memory_order_relaxed);
+        if ((state & 1) && state >> 1 != e)
+            return;
+    }
+    if (!atomic_compare_exchange_strong(&global_epoch, &e, e + 1))
+        return;
+
+    pthread_mutex_lock(&epoch_lock);
+    for (rec = atomic_load(&epoch_recs); rec != NULL; rec = rec->next) {
+        if (atomic_load(&rec->in_use))
+            continue;
+        for (i = 0; i < 3; i++) {
+            if (rec->bags[i] != NULL && rec->bag_epoch[i] + 2 <= e + 1)
+                bag_free(rec, i);
+        }
+    }
+    pthread_mutex_unlock(&epoch_lock);
+}
+
+// leave a record's bags for epoch_advance to reap when its thread exits
+static void epoch_rec_release(void *rec)
+{
+    my_epoch_rec = NULL;
+    ((EpochRec *) rec)->nesting = 0;
+    atomic_store(&((EpochRec *) rec)->state, 0);
+    atomic_store(&((EpochRec *) rec)->in_use, false);
+}
+
+static void epoch_key_create(void)
+{
+    pthread_key_create(&epoch_key, epoch_rec_release);
+}
+
+/* get the calling thread's epoch record, reusing one left by an exited
+ * thread if there is one. returns NULL if no record could be mapped. */
+static EpochRec *epoch_rec_get(void)
+{
+    EpochRec *rec;
+
+    if (my_epoch_rec != NULL)
+        return my_epoch_rec;
+
+    pthread_once(&epoch_key_once, epoch_key_create);
+    pthread_mutex_lock(&epoch_lock);
+    for (rec = atomic_load(&epoch_recs); rec != NULL; rec = rec->next) {
+        if (!atomic_load(&rec->in_use))
+            break;
+    }
+    if (rec == NULL) {
+        rec = mmap(NULL, sizeof(EpochRec), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (rec == MAP_FAILED) {
+            pthread_mutex_unlock(&epoch_lock);
+            return NULL;
+        }
+        rec->next = atomic_load(&epoch_recs);
+        atomic_store(&epoch_recs, rec);
+    }
+    atomic_store(&rec->in_use, true);
+    pthread_mutex_unlock(&epoch_lock);
+
+    pthread_setspecific(epoch_key, rec);
+    my_epoch_rec = rec;
+    return rec;
+}
+
+/* ma_pheap_open - map the heap in the file at path, creating it with room
+ * for capacity bytes if it doesn't exist. the file is sized up front but
+ * stays sparse until it's used. an existing heap is mapped as it was left
+ * without being scanned. */
+ma_pheap *ma_pheap_open(const char *path, size_t capacity)
+{
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    return pheap_map(fd, capacity, st.st_size == 0, false);
+}
+
+/* ma_shm_open - map the shared heap in the posix shared memory object
+ * name, creating it with room for capacity bytes if it doesn't exist.
+ * every process that opens it can free what the others allocate. */
+ma_pheap *ma_shm_open(const char *name, size_t capacity)
+{
+    int fd;
+
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) >= 0)
+        return pheap_map(fd, capacity, true, true);
+    if (errno != EEXIST || (fd = shm_open(name, O_RDWR, 0)) < 0)
+        return NULL;
+    return pheap_map(fd, capacity, false, true);
+}
+
+/* ma_shm_attach - map a shared heap from a descriptor, such as a memfd
+ * passed from another process. a descriptor for an empty region becomes a
+ * new heap of capacity bytes, so the creating process should attach before
+ * handing the descriptor on. fd stays open. */
+ma_pheap *ma_shm_attach(int fd, size_t capacity)
+{
+    struct stat st;
+
+    if ((fd = dup(fd)) < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    return pheap_map(fd, capacity, st.st_size == 0, true);
+}
+
+/* map the heap in fd, setting it up first if create is set, and close fd.
+ * a shared heap's lock is process shared and robust, and is only set up
+ * by its creator; a file heap's lock is reset on every open since nothing
+ * else can hold it. */
+static PHeap *pheap_map(int fd, size_t capacity, bool create, bool shared)
+{
+    pthread_mutexattr_t attr;
+    struct stat st;
+    PHeap *ph;
+    Heap *h;
+
+    pthread_mutex_lock(&heap_lock);
+    if (malloc_init() < 0) {
+        pthread_mutex_unlock(&heap_lock);
+        close(fd);
+        return NULL;
+    }
+    pthread_mutex_unlock(&heap_lock);
+
+    if (create) {
+        capacity = ROUNDUP(capacity, page_size);
+        if (capacity < PHEAPSTART + page_size ||
+            ftruncate(fd, capacity) < 0) {
+            close(fd);
+            errno = EINVAL;
+            return NULL;
+        }
+    } else {
+        // a shared heap may still be being created by another process
+        while (fstat(fd, &st) == 0 && st.st_size == 0 && shared)
+            sched_yield();
+        capacity = st.st_size;
+    }
+    ph = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ph == MAP_FAILED)
+        return NULL;
+
+    h = &ph->heap;
+    if (create) {
+        h->prologue = (Block *) ((void *) ph + PHEAPSTART - WSIZE);
+        h->epilogue = (Block *) ((void *) h->prologue + WSIZE);
+        BOUNDINIT(h->prologue);
+        BOUNDINIT(h->epilogue);
+        h->base = (uintptr_t) ph;
+        ph->capacity = capacity;
+        pthread_mutexattr_init(&attr);
+        if (shared) {
+            pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+            pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        }
+        pthread_mutex_init(&ph->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        // set last, so a heap whose creation was cut short isn't opened
+        atomic_thread_fence(memory_order_release);
+        ph->magic = PHEAPMAGIC;
+    } else {
+        while (shared && ((volatile PHeap *) ph)->magic != PHEAPMAGIC)
+            sched_yield();
+        atomic_thread_fence(memory_order_acquire);
+        if (ph->magic != PHEAPMAGIC || ph->capacity != capacity) {
+            munmap(ph, capacity);
+            errno = EINVAL;
+            return NULL;
+        }
+        if (!shared)
+            pthread_mutex_init(&ph->lock, NULL);
+    }
+    if (!shared)
+        pheap_rebase(ph);
+    return ph;
+}
+
+/* point the heap's bounds at this process's mapping of ph. the links are
+ * offsets and need nothing, so this is cheap enough to do every time a
+ * shared heap's lock is taken - the process holding the lock is the only
+ * one using the bounds. */
+static void pheap_rebase(PHeap *ph)
+{
+    Heap *h = &ph->heap;
+    intptr_t delta = (uintptr_t) ph - h->base;
+
+    if (delta != 0) {
+        h->prologue = (Block *) ((void *) h->prologue + delta);
+        h->epilogue = (Block *) ((void *) h->epilogue + delta);
+        h->base = (uintptr_t) ph;
+    }
+    // the whole region is mapped, so the heap never commits more memory
+    h->top = (void *) ph + ph->capacity;
+    h->limit = h->top;
+    h->hp_used = NULL;
+}
+
+/* take ph's lock. if a process died holding it, the heap is used as that
+ * process left it. */
+static void pheap_lock(PHeap *ph)
+{
+    if (pthread_mutex_lock(&ph->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&ph->lock);
+    pheap_rebase(ph);
+}
+
+// ma_pheap_close - write the heap back to its file and unmap it
+void ma_pheap_close(ma_pheap *ph)
+{
+    msync(ph, ph->capacity, MS_SYNC);
+    munmap(ph, ph->capacity);
+}
+
+// ma_pmalloc - allocate size bytes from a file backed or shared heap
+void *ma_pmalloc(ma_pheap *ph, size_t size)
+{
+    void *userptr;
+
+    if (size == 0)
+        return NULL;
+    if (size > ALIGN(BLOCKSIZE(size))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    pheap_lock(ph);
+    userptr = malloc_block(&ph->heap, ALIGN(BLOCKSIZE(size)));
+    pthread_mutex_unlock(&ph->lock);
+    return userptr;
+}
+
+/* ma_pfree - free an allocation from a file backed or shared heap. it's
+ * coalesced right away, since the maintenance thread only looks at process
+ * heaps. */
+void ma_pfree(ma_pheap *ph, void *ptr)
+{
+    Block *b;
+
+    if (ptr == NULL)
+        return;
+    pheap_lock(ph);
+    b = coalesce(&ph->heap, USERTOBLOCK(ptr));
+    free_list_insert(&ph->heap, b, true);
+    pthread_mutex_unlock(&ph->lock);
+}
+
+/* ma_pheap_root - get the object a heap's data structures hang off, as
+ * set by ma_pheap_set_root, at wherever the heap is mapped now */
+void *ma_pheap_root(ma_pheap *ph)
+{
+    return ma_pheap_ptr(ph, ph->root);
+}
+
+void ma_pheap_set_root(ma_pheap *ph, void *ptr)
+{
+    ph->root = ma_pheap_offset(ph, ptr);
+}
+
+/* ma_pheap_offset - convert a pointer into ph to an offset that stays
+ * valid across mappings. NULL becomes 0. */
+size_t ma_pheap_offset(ma_pheap *ph, const void *ptr)
+{
+    return ptr == NULL ? 0 : (uintptr_t) ptr - (uintptr_t) ph;
+}
+
+// ma_pheap_ptr - convert an offset from ma_pheap_offset back to a pointer
+void *ma_pheap_ptr(ma_pheap *ph, size_t off)
+{
+    return off == 0 ? NULL : (void *) ph + off;
+}
+
+/* reserve the slab region and its metadata. if either can't be mapped,
+ * the allocator runs without the slab region. */
+static void slab_init(void)
+{
+    void *base, *runs;
+
+    base = mmap(NULL, SLABRESERVE, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+        return;
+    runs = mmap(NULL, SLABRESERVE / SLABRUN * sizeof(SlabRun),
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (runs == MAP_FAILED) {
+        munmap(base, SLABRESERVE);
+        return;
+    }
+    slab_runs = runs;
+    slab_base = base;
+}
+
+/* commit the next run of the slab region for objects of the given size.
+ * returns one more than its index, or 0 if the region is full. */
+static uint32_t slab_new_run(size_t size)
+{
+    SlabRun *run;
+    size_t n;
+
+    if (slab_count == SLABRESERVE / SLABRUN)
+        return 0;
+    limit_soft(SLABRUN);
+    if (!footprint_grow(SLABRUN))
+        return 0;
+    stats.grow_calls++;
+    if (mprotect(slab_base + slab_count * SLABRUN, SLABRUN,
+                 PROT_READ | PROT_WRITE) < 0) {
+        stats.footprint -= SLABRUN;
+        return 0;
+    }
+    run = &slab_runs[slab_count];
+    run->size = size;
+    run->nfree = n = SLABRUN / size;
+    run->next = 0;
+    memset(run->free, 0xff, n / 64 * sizeof(uint64_t));
+    if (n % 64 != 0)
+        run->free[n / 64] = (1ull << (n % 64)) - 1;
+    return ++slab_count;
+}
+
+// allocate size bytes from the slab region - size is at most SLABMAX
+static void *slab_alloc(size_t size)
+{
+    size_t cls = (size + 15) / 16 - 1;
+    uint32_t r;
+
+    if ((r = slab_partial[cls]) == 0) {
+        if ((r = slab_new_run((cls + 1) * 16)) == 0) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        slab_partial[cls] = r;
+    }
+    return slab_take(&slab_partial[cls]);
+}
+
+/* take a free object from the run that link points to, which is on a
+ * chain of partly used runs */
+static void *slab_take(uint32_t *link)
+{
+    uint32_t r = *link;
+    SlabRun *run = &slab_runs[r - 1];
+    size_t w;
+    int bit;
+
+    for (w = 0; run->free[w] == 0; w++)
+        ;
+    bit = __builtin_ctzll(run->free[w]);
+    run->free[w] &= ~(1ull << bit);
+    // a full run leaves its chain until something in it is freed
+    if (--run->nfree == 0) {
+        *link = run->next;
+        run->next = 0;
+    }
+    return slab_base + (r - 1) * SLABRUN + (w * 64 + bit) * run->size;
+}
+
+// free an object in the slab region, touching only its run's metadata
+static void slab_free(void *ptr)
+{
+    size_t r = (ptr - slab_base) / SLABRUN, i;
+    SlabRun *run = &slab_runs[r];
+
+    i = (ptr - slab_base - r * SLABRUN) / run->size;
+    if (run->free[i / 64] & 1ull << (i % 64)) {
+        fprintf(stderr, "free: double free of %p\n", ptr);
+        return;
+    }
+    run->free[i / 64] |= 1ull << (i % 64);
+    if (run->nfree++ == 0) {
+        run->next = slab_partial[run->size / 16 - 1];
+        slab_partial[run->size / 16 - 1] = r + 1;
+    }
+}
+
+/* resize a slab object. it stays put if it still fits, and otherwise
+ * moves to the slab class or heap that the new size belongs in. */
+static void *slab_realloc(void *ptr, size_t size)
+{
+    size_t old_size = slab_runs[(ptr - slab_base) / SLABRUN].size;
+    void *new;
+
+    if (size <= old_size)
+        return ptr;
+    new = size <= SLABMAX ? slab_alloc(size) :
+          size >= large_min ? large_alloc(size, 0) :
+                              malloc_block(&main_heap, ALIGN(BLOCKSIZE(size)));
+    if (new == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memcpy(new, ptr, old_size);
+    slab_free(ptr);
+    return new;
+}
+
+/* fork handlers, registered when the library loads. every allocator lock
+ * is held across fork so the child gets the heaps in a consistent state.
+ * epoch_lock, rings_lock and tcaches_lock are each taken before heap_lock
+ * and never while another of them is held, so taking all four in this
+ * order can't deadlock. locks of file backed and shared heaps belong to
+ * their users and aren't touched. */
+static void fork_prepare(void)
+{
+    pthread_mutex_lock(&epoch_lock);
+    pthread_mutex_lock(&rings_lock);
+    pthread_mutex_lock(&tcaches_lock);
+    pthread_mutex_lock(&heap_lock);
+}
+
+static void fork_parent(void)
+{
+    pthread_mutex_unlock(&heap_lock);
+    pthread_mutex_unlock(&tcaches_lock);
+    pthread_mutex_unlock(&rings_lock);
+    pthread_mutex_unlock(&epoch_lock);
+}
+
+/* only the forking thread exists in the child. what other threads queued
+ * for the helper or held in their caches is freed now and their rings and
+ * caches dropped, and their epoch records are released so they can't hold
+ * the epoch back. the quick lists are emptied too, and a pop that was
+ * under way is forgotten so it can't hold trimming back. the helper and
+ * maintenance threads are started again if they were running. */
+static void fork_child(void)
+{
+    FreeRing *ring, *next;
+    TCache *tc, *tc_next;
+    EpochRec *rec;
+
+    pthread_mutex_init(&heap_lock, NULL);
+    pthread_mutex_init(&rings_lock, NULL);
+    pthread_mutex_init(&tcaches_lock, NULL);
+    pthread_mutex_init(&epoch_lock, NULL);
+
+    atomic_store(&quick_poppers, 0);
+    bg_cursor = NULL;
+    if (quick_on) {
+        pthread_mutex_lock(&heap_lock);
+        quick_flush();
+        pthread_mutex_unlock(&heap_lock);
+    }
+
+    for (tc = tcaches, tcaches = NULL; tc != NULL; tc = tc_next) {
+        tc_next = tc->next;
+        // a spinlock held by a thread that's gone would never be freed
+        atomic_flag_clear(&tc->lock);
+        if (tc == my_tcache) {
+            tc->next = NULL;
+            tcaches = tc;
+        } else {
+            tcache_drain(tc);
+            munmap(tc, sizeof(TCache));
+        }
+    }
+
+    for (ring = rings, rings = NULL; ring != NULL; ring = next) {
+        next = ring->next;
+        while (ring_drain(ring) != 0)
+            ;
+        if (ring == my_ring) {
+            ring->next = NULL;
+            rings = ring;
+        } else {
+            munmap(ring, sizeof(FreeRing));
+        }
+    }
+    if (helper_started) {
+        helper_started = false;
+        if (rings != NULL && !helper_spawn()) {
+            my_ring = NULL;
+            async_free = false;
+            munmap(rings, sizeof(FreeRing));
+            rings = NULL;
+        }
+    }
+
+    for (rec = atomic_load(&epoch_recs); rec != NULL; rec = rec->next) {
+        if (rec != my_epoch_rec) {
+            rec->nesting = 0;
+            atomic_store(&rec->state, 0);
+            atomic_store(&rec->in_use, false);
+        }
+    }
+
+    maintenance_spawn();
+}
+
+/* get the page map entry for the page at p, mapping the parts of the tree
+ * it needs if create is set. returns NULL if they aren't there. */
+static size_t *map_entry(void *p, bool create)
+{
+    uintptr_t page = (uintptr_t) p >> page_shift;
+    size_t i = page >> MAPLEAFBITS;
+    void *m;
+
+    if (page_map == NULL || page_map[i] == NULL) {
+        if (!create)
+            return NULL;
+        if (page_map == NULL) {
+            m = mmap(NULL, sizeof(size_t *) << (MAPBITS - page_shift -
+                                                MAPLEAFBITS),
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (m == MAP_FAILED)
+                return NULL;
+            page_map = m;
+        }
+        m = mmap(NULL, sizeof(size_t) << MAPLEAFBITS, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (m == MAP_FAILED)
+            return NULL;
+        page_map[i] = m;
+    }
+    return &page_map[i][page & (((size_t) 1 << MAPLEAFBITS) - 1)];
+}
+
+/* number of pages in the large allocation at p, or 0 if p isn't one. heap
+ * pointers can be page aligned too, but their pages have no entry. */
+static size_t large_pages(void *p)
+{
+    size_t *entry;
+
+    if ((uintptr_t) p & (page_size - 1))
+        return 0;
+    entry = map_entry(p, false);
+    // the entry's top bits hold the allocation's tag
+    return entry == NULL ? 0 : *entry & ~TAGBITS;
+}
+
+/* give size bytes their own mapping aligned to align, which is at least a
+ * page, or 0 if malloc's alignment will do. small mappings are reused from
+ * the cache when possible, and sizes the buddy region covers come from
+ * there instead. with a reservation, requests that don't need alignment
+ * take a free heap block first, so they need no system call. */
+static void *large_alloc(size_t size, size_t align)
+{
+    size_t pages, len, extra = align > page_size ? align : 0;
+    size_t *entry;
+    void *p, *start;
+
+    if (reserve_end != NULL) {
+        if (align == 0 && (p = reserve_alloc(size)) != NULL)
+            return p;
+        stats.outside_reserve++;
+    }
+    // buddy blocks are aligned to their size
+    if (buddy_base != NULL && size <= BUDDYMAX && align <= BUDDYMAX)
+        return buddy_alloc(size > align ? size : align);
+
+    if (size > SIZE_MAX - page_size - extra) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    pages = ROUNDUP(size, page_size) >> page_shift;
+    len = pages << page_shift;
+    if (extra == 0 && pages <= LARGEBINS && large_cache[pages - 1] != NULL) {
+        p = large_cache[pages - 1];
+        large_cache[pages - 1] = *(void **) p;
+        large_cached -= len;
+    } else {
+        limit_soft(len);
+        if (!footprint_grow(len))
+            return NULL;
+        stats.grow_calls++;
+        p = mmap(NULL, len + extra, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            stats.footprint -= len;
+            errno = ENOMEM;
+            return NULL;
+        }
+        if (extra != 0) {
+            // trim the mapping down to an aligned run of len bytes
+            start = p;
+            p = (void *) ROUNDUP((uintptr_t) p, align);
+            if (p != start)
+                munmap(start, p - start);
+            munmap(p + len, start + len + extra - (p + len));
+        }
+    }
+    if ((entry = map_entry(p, true)) == NULL) {
+        munmap(p, len);
+        stats.footprint -= len;
+        errno = ENOMEM;
+        return NULL;
+    }
+    *entry = pages;
+    return p;
+}
+
+// release a large allocation of the given number of pages
+static void large_free(void *p, size_t pages)
+{
+    size_t len = pages << page_shift;
+
+    *map_entry(p, false) = 0;
+    if (pages <= LARGEBINS && large_cached + len <= LARGECACHE) {
+        *(void **) p = large_cache[pages - 1];
+        large_cache[pages - 1] = p;
+        large_cached += len;
+        return;
+    }
+    munmap(p, len);
+    stats.footprint -= len;
+}
+
+/* resize a large allocation. it's moved with mremap, so no bytes are
+ * copied, unless it shrinks below large_min and goes to the heap. */
+static void *large_realloc(void *ptr, size_t pages, size_t size)
+{
+    size_t new_pages, *entry;
+    void *new;
+
+    if (size < large_min) {
+        if ((new = malloc_block(&main_heap, ALIGN(BLOCKSIZE(size)))) == NULL)
+            return NULL;
+        memcpy(new, ptr, size);
+        large_free(ptr, pages);
+        return new;
+    }
+    if (size > SIZE_MAX - page_size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    new_pages = ROUNDUP(size, page_size) >> page_shift;
+    if (new_pages == pages)
+        return ptr;
+    if (new_pages > pages) {
+        limit_soft((new_pages - pages) << page_shift);
+        if (!footprint_grow((new_pages - pages) << page_shift))
+            return NULL;
+    }
+    stats.grow_calls++;
+    new = mremap(ptr, pages << page_shift, new_pages << page_shift,
+                 MREMAP_MAYMOVE);
+    if (new == MAP_FAILED) {
+        if (new_pages > pages)
+            stats.footprint -= (new_pages - pages) << page_shift;
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (new_pages < pages)
+        stats.footprint -= (pages - new_pages) << page_shift;
+    *map_entry(ptr, false) = 0;
+    if ((entry = map_entry(new, true)) == NULL) {
+        // can't track it - hand back the old size's worth as lost
+        fprintf(stderr, "realloc: couldn't map page table\n");
+        munmap(new, new_pages << page_shift);
+        stats.footprint -= new_pages << page_shift;
+        errno = ENOMEM;
+        return NULL;
+    }
+    *entry = new_pages;
+    return new;
+}
+
+/* posix_memalign - allocate size bytes aligned to alignment. large or
+ * page aligned requests get their own mapping; anything else is carved
+ * out of a bigger heap block. */
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *userptr = NULL;
+
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)))
+        return EINVAL;
+    if (alignment <= WSIZE) {
+        *memptr = malloc(size);
+        return *memptr == NULL && size != 0 ? ENOMEM : 0;
+    }
+    if (size == 0) {
+        *memptr = NULL;
+        return 0;
+    }
+    if (size > SIZE_MAX / 2 - alignment)
+        return ENOMEM;
+    pthread_mutex_lock(&heap_lock);
+    if (malloc_init() == 0) {
+        if (size >= large_min || alignment >= page_size)
+            userptr = large_alloc(size, alignment);
+        else
+            userptr = malloc_aligned(size, alignment);
+        if (my_tag != 0 && userptr != NULL)
+            tag_give(userptr, my_tag);
+    }
+    pthread_mutex_unlock(&heap_lock);
+    if (userptr == NULL)
+        return ENOMEM;
+    *memptr = userptr;
+    return 0;
+}
+
+/* allocate size bytes at an alignment under a page from the main heap.
+ * the block is allocated with room to move the start forward to an
+ * aligned address and still leave a whole free block in front. */
+static void *malloc_aligned(size_t size, size_t alignment)
+{
+    void *userptr, *aligned;
+    Block *b, *lead;
+    size_t total;
+
+    userptr = malloc_block(&main_heap,
+                           ALIGN(BLOCKSIZE(size + alignment + MINBLOCK)));
+    if (userptr == NULL)
+        return NULL;
+    lead = USERTOBLOCK(userptr);
+    aligned = (void *) ROUNDUP((uintptr_t) userptr + MINBLOCK, alignment);
+    b = USERTOBLOCK(aligned);
+    total = SIZE(lead);
+    SETSIZE(lead, (void *) b - (void *) lead);
+    b->size = 0;
+    MARKALLOC(b);
+    SETSIZE(b, total - SIZE(lead));
+    free_block(lead);
+    split(&main_heap, b, ALIGN(BLOCKSIZE(size)));
+    return aligned;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    void *userptr;
+    int err;
+
+    if ((err = posix_memalign(&userptr, alignment, size)) != 0) {
+        errno = err;
+        return NULL;
+    }
+    return userptr;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    return aligned_alloc(alignment, size);
+}
+
+/* reserve the buddy region and its bitmaps, order map and links. the
+ * allocator runs without it if they can't be mapped. */
+static void buddy_init(void)
+{
+    size_t pages = BUDDYRESERVE >> page_shift, bits = 0;
+    void *base, *meta;
+    int k;
+
+    buddy_orders = 20 - page_shift + 1;
+    if (buddy_orders < 1 || buddy_orders > BUDDYORDERS)
+        return;
+    for (k = 0; k < buddy_orders; k++)
+        bits += ROUNDUP(pages >> k, 64);
+    base = mmap(NULL, BUDDYRESERVE + BUDDYMAX, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+        return;
+    meta = mmap(NULL, pages * sizeof(BuddyFree) + 2 * pages + bits / 8,
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (meta == MAP_FAILED) {
+        munmap(base, BUDDYRESERVE + BUDDYMAX);
+        return;
+    }
+    buddy_links = meta;
+    meta += pages * sizeof(BuddyFree);
+    buddy_order = meta;
+    buddy_tag = meta + pages;
+    meta += 2 * pages;
+    for (k = 0; k < buddy_orders; k++) {
+        buddy_bits[k] = meta;
+        meta += ROUNDUP(pages >> k, 64) / 8;
+    }
+    buddy_base = (void *) ROUNDUP((uintptr_t) base, BUDDYMAX);
+}
+
+#define BUDDYBIT(k, page)    (buddy_bits[k][((page) >> (k)) / 64] & \
+                              1ull << (((page) >> (k)) % 64))
+#define BUDDYSET(k, page)    (buddy_bits[k][((page) >> (k)) / 64] |= \
+                              1ull << (((page) >> (k)) % 64))
+#define BUDDYCLR(k, page)    (buddy_bits[k][((page) >> (k)) / 64] &= \
+                              ~(1ull << (((page) >> (k)) % 64)))
+#define BUDDYPTR(page)       (buddy_base + ((size_t) (page) << page_shift))
+#define BUDDYPAGE(p)         ((size_t) ((void *) (p) - buddy_base) >> page_shift)
+
+// put the free block at page on the list for order k
+static void buddy_push(size_t page, int k)
+{
+    BuddyFree *f = &buddy_links[page];
+
+    f->prev = 0;
+    f->next = buddy_lists[k];
+    if (f->next != 0)
+        buddy_links[f->next - 1].prev = page + 1;
+    buddy_lists[k] = page + 1;
+    BUDDYSET(k, page);
+}
+
+static void buddy_unlink(size_t page, int k)
+{
+    BuddyFree *f = &buddy_links[page];
+
+    if (f->prev != 0)
+        buddy_links[f->prev - 1].next = f->next;
+    else
+        buddy_lists[k] = f->next;
+    if (f->next != 0)
+        buddy_links[f->next - 1].prev = f->prev;
+    BUDDYCLR(k, page);
+}
+
+/* allocate a block of the smallest order that holds size bytes, splitting
+ * a bigger block or committing a new top order block if none is free */
+static void *buddy_alloc(size_t size)
+{
+    size_t pages = ROUNDUP(size, page_size) >> page_shift, page;
+    int k = pages <= 1 ? 0 : 64 - __builtin_clzll(pages - 1), j;
+
+    for (j = k; j < buddy_orders && buddy_lists[j] == 0; j++)
+        ;
+    if (j == buddy_orders) {
+        // commit another top order block
+        j = buddy_orders - 1;
+        if (buddy_chunks == BUDDYRESERVE / BUDDYMAX) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        limit_soft(BUDDYMAX);
+        if (!footprint_grow(BUDDYMAX))
+            return NULL;
+        stats.grow_calls++;
+        if (mprotect(buddy_base + buddy_chunks * BUDDYMAX, BUDDYMAX,
+                     PROT_READ | PROT_WRITE) < 0) {
+            stats.footprint -= BUDDYMAX;
+            errno = ENOMEM;
+            return NULL;
+        }
+        page = BUDDYPAGE(buddy_base + buddy_chunks++ * BUDDYMAX);
+    } else {
+        page = buddy_lists[j] - 1;
+        // pages that were given back count against the limits again
+        if (buddy_order[page] == BUDDYPURGED) {
+            limit_soft(BUDDYMAX);
+            if (!footprint_grow(BUDDYMAX))
+                return NULL;
+            buddy_order[page] = 0;
+        }
+        buddy_unlink(page, j);
+        if (j == buddy_orders - 1)
+            buddy_free_top--;
+    }
+    // split down to order k, freeing the upper half each time
+    while (j > k) {
+        j--;
+        buddy_push(page + ((size_t) 1 << j), j);
+    }
+    buddy_order[page] = k + 1;
+    return BUDDYPTR(page);
+}
+
+/* free a buddy block, merging it with its buddy for as long as the buddy
+ * is free. beyond BUDDYKEEP free top order blocks, their pages are given
+ * back to the system. */
+static void buddy_free(void *p)
+{
+    size_t page = BUDDYPAGE(p), buddy;
+    int k = buddy_order[page] - 1;
+
+    if (k < 0 || k >= buddy_orders) {
+        fprintf(stderr, "free: double free of %p\n", p);
+        return;
+    }
+    buddy_order[page] = 0;
+    for (; k < buddy_orders - 1; k++) {
+        buddy = page ^ ((size_t) 1 << k);
+        if (!BUDDYBIT(k, buddy))
+            break;
+        buddy_unlink(buddy, k);
+        page &= ~((size_t) 1 << k);
+    }
+    if (k == buddy_orders - 1 && ++buddy_free_top > BUDDYKEEP) {
+        madvise(BUDDYPTR(page), BUDDYMAX, MADV_DONTNEED);
+        buddy_order[page] = BUDDYPURGED;
+        stats.footprint -= BUDDYMAX;
+    }
+    buddy_push(page, k);
+}
+
+/* resize a buddy block. it stays put if the new size needs the same
+ * order, and otherwise moves to wherever that size is served from. */
+static void *buddy_realloc(void *ptr, size_t size)
+{
+    size_t old_size = page_size << (buddy_order[BUDDYPAGE(ptr)] - 1);
+    void *new;
+
+    if (size <= old_size && size > old_size / 2 && size >= large_min)
+        return ptr;
+    new = size >= large_min ? large_alloc(size, 0) :
+          slab_base != NULL && size <= SLABMAX ? slab_alloc(size) :
+          malloc_block(&main_heap, ALIGN(BLOCKSIZE(size)));
+    if (new == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memcpy(new, ptr, size < old_size ? size : old_size);
+    buddy_free(ptr);
+    return new;
+}
+
+/* pop a block of size i * 8 off its quick list, or return NULL if it's
+ * empty. the next link is read from a block that another thread may have
+ * popped and reused meanwhile, but then the tag has moved on and the swap
+ * fails. the block may even have been freed, so quick_poppers keeps
+ * trim_heap from unmapping it under us - the head is loaded after the
+ * count goes up, and both are sequentially consistent, so a trim that
+ * follows the block being taken off the list sees the count. */
+static Block *quick_pop(size_t i)
+{
+    uint64_t head, new;
+    Block *b;
+
+    atomic_fetch_add(&quick_poppers, 1);
+    head = atomic_load(&quick_heads[i]);
+    do {
+        if ((b = (Block *) (uintptr_t) (head & QUICKPTR)) == NULL)
+            break;
+        new = QUICKTAG(head) |
+              __atomic_load_n(&b->next, __ATOMIC_RELAXED);
+    } while (!atomic_compare_exchange_weak(&quick_heads[i], &head, new));
+    atomic_fetch_sub_explicit(&quick_poppers, 1, memory_order_release);
+    if (b == NULL)
+        return NULL;
+    QUICKCOUNT(i, -1);
+    MARKUNQUICK(b);
+    return b;
+}
+
+/* push an allocated block onto the quick list for its size. returns false
+ * if the list is full and the block should be freed normally. only the
+ * header gets the quick bit - the footer's allocated bit already keeps
+ * neighbors from coalescing with it. */
+static bool quick_push(Block *b)
+{
+    size_t i = SIZE(b) / 8;
+    uint64_t head, new;
+
+    if (atomic_load_explicit(&quick_counts[i], memory_order_relaxed) >=
+        QUICKCAP)
+        return false;
+    QUICKCOUNT(i, 1);
+    MARKQUICK(b);
+    head = atomic_load_explicit(&quick_heads[i], memory_order_relaxed);
+    do {
+        __atomic_store_n(&b->next, head & QUICKPTR, __ATOMIC_RELAXED);
+        new = QUICKTAG(head) | (uintptr_t) b;
+    } while (!atomic_compare_exchange_weak_explicit(&quick_heads[i], &head,
+                                                    new,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    return true;
+}
+
+/* move every quick block back to the free lists of its heap. each list is
+ * detached whole, which is safe against concurrent pops. called with
+ * heap_lock held. returns true if anything was freed. */
+static bool quick_flush(void)
+{
+    uint64_t head;
+    Block *b, *next;
+    bool freed = false;
+    size_t i;
+
+    for (i = 0; i < QUICKLISTS; i++) {
+        head = atomic_load_explicit(&quick_heads[i], memory_order_acquire);
+        if ((head & QUICKPTR) == 0)
+            continue;
+        // sequentially consistent, as quick_pop's are
+        while (!atomic_compare_exchange_weak(&quick_heads[i], &head,
+                                             QUICKTAG(head)))
+            ;
+        atomic_store_explicit(&quick_counts[i], 0, memory_order_relaxed);
+        for (b = (Block *) (uintptr_t) (head & QUICKPTR); b != NULL;
+             b = next) {
+            next = (Block *) b->next;
+            MARKUNQUICK(b);
+            free_block(b);
+            freed = true;
+        }
+    }
+    return freed;
+}
+
+static void tcache_key_create(void)
+{
+    pthread_key_create(&tcache_key, tcache_exit);
+}
+
+/* get the calling thread's cache, creating it on first use. returns NULL
+ * once the thread has started exiting or if it couldn't be mapped. */
+static TCache *tcache_get(void)
+{
+    TCache *tc = my_tcache;
+    size_t i;
+
+    if (tc != NULL || tcache_done)
+        return tc;
+    tc = mmap(NULL, sizeof(TCache), PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (tc == MAP_FAILED) {
+        tcache_done = true;
+        return NULL;
+    }
+    atomic_flag_clear(&tc->lock);
+    for (i = 0; i < QUICKLISTS; i++)
+        tc->bins[i].max = TCACHEMIN;
+    // set before pthread_setspecific, which may call malloc
+    my_tcache = tc;
+    pthread_once(&tcache_key_once, tcache_key_create);
+    pthread_setspecific(tcache_key, tc);
+    pthread_mutex_lock(&tcaches_lock);
+    tc->next = tcaches;
+    tcaches = tc;
+    pthread_mutex_unlock(&tcaches_lock);
+    return tc;
+}
+
+#define TCACHELOCK(tc)   while (atomic_flag_test_and_set_explicit(&(tc)->lock, \
+                                memory_order_acquire)) \
+                             sched_yield()
+#define TCACHEUNLOCK(tc) atomic_flag_clear_explicit(&(tc)->lock, \
+                                                    memory_order_release)
+
+// take a block of size i * 8 from tc, or NULL if it has none
+static Block *tcache_pop(TCache *tc, size_t i)
+{
+    TCacheBin *bin = &tc->bins[i];
+    Block *b;
+
+    TCACHELOCK(tc);
+    tc->ops++;
+    if ((b = bin->head) != NULL) {
+        bin->head = (Block *) b->next;
+        bin->count--;
+        tc->bytes -= i * 8;
+    }
+    TCACHEUNLOCK(tc);
+    return b;
+}
+
+/* handle a miss for size i * 8 - grow the size's capacity and fill half
+ * of it from the quick lists and the heap under one hold of heap_lock.
+ * returns a block for the caller, or NULL if the heap is out of memory. */
+static Block *tcache_refill(TCache *tc, size_t i)
+{
+    TCacheBin *bin = &tc->bins[i];
+    Block *b, *chain = NULL, *found = NULL;
+    uint32_t want, n = 0;
+    bool gc;
+
+    TCACHELOCK(tc);
+    bin->misses++;
+    if (bin->max < TCACHEMAX)
+        bin->max *= 2;
+    want = bin->max / 2;
+    if (want > (tcache_bytes - tc->bytes) / (i * 8))
+        want = (tcache_bytes - tc->bytes) / (i * 8);
+    TCACHEUNLOCK(tc);
+
+    pthread_mutex_lock(&heap_lock);
+    while (found == NULL || n < want) {
+        if ((b = quick_pop(i)) == NULL) {
+            if ((b = malloc_block(&main_heap, i * 8)) == NULL)
+                break;
+            b = USERTOBLOCK(b);
+            // a block too big to split fits no other request of this size
+            if (SIZE(b) != i * 8) {
+                if (found == NULL) {
+                    found = b;
+                    continue;
+                }
+                free_block(b);
+                break;
+            }
+        }
+        if (found == NULL) {
+            found = b;
+        } else {
+            b->next = (uintptr_t) chain;
+            chain = b;
+            n++;
+        }
+    }
+    gc = (++tcache_refills % TCACHEGC == 0 && bg_interval_ms == 0) ||
+         tcache_flush_all;
+    pthread_mutex_unlock(&heap_lock);
+
+    if (chain != NULL) {
+        TCACHELOCK(tc);
+        for (; chain != NULL; chain = b) {
+            b = (Block *) chain->next;
+            chain->next = (uintptr_t) bin->head;
+            bin->head = chain;
+            bin->count++;
+            tc->bytes += i * 8;
+        }
+        TCACHEUNLOCK(tc);
+    }
+    if (gc)
+        tcache_gc();
+    return found;
+}
+
+/* cache a freed block in tc. if its size is full or the cache is over
+ * budget, the block and half of its size's blocks go back to the heap,
+ * and a size that overflows more often than it misses is shrunk. */
+static void tcache_push(TCache *tc, Block *b)
+{
+    size_t i = SIZE(b) / 8;
+    TCacheBin *bin = &tc->bins[i];
+    Block *chain, *next;
+    uint32_t n;
+
+    TCACHELOCK(tc);
+    tc->ops++;
+    if (bin->count < bin->max && tc->bytes + i * 8 <= tcache_bytes) {
+        b->next = (uintptr_t) bin->head;
+        bin->head = b;
+        bin->count++;
+        tc->bytes += i * 8;
+        TCACHEUNLOCK(tc);
+        return;
+    }
+    if (++bin->overflows > bin->misses && bin->max > TCACHEMIN) {
+        bin->max /= 2;
+        bin->misses = bin->overflows = 0;
+    }
+    b->next = 0;
+    chain = b;
+    for (n = bin->count / 2; n > 0; n--) {
+        next = bin->head;
+        bin->head = (Block *) next->next;
+        next->next = (uintptr_t) chain;
+        chain = next;
+        bin->count--;
+        tc->bytes -= i * 8;
+    }
+    TCACHEUNLOCK(tc);
+
+    pthread_mutex_lock(&heap_lock);
+    for (; chain != NULL; chain = next) {
+        next = (Block *) chain->next;
+        free_block(chain);
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/* free every block in tc and shrink its sizes back to the minimum. the
+ * caller holds tc's lock or is the only thread that can use tc. */
+static void tcache_drain(TCache *tc)
+{
+    pthread_mutex_lock(&heap_lock);
+    tcache_empty(tc);
+    pthread_mutex_unlock(&heap_lock);
+}
+
+// tcache_drain, for callers that hold heap_lock
+static void tcache_empty(TCache *tc)
+{
+    Block *b, *next;
+    size_t i;
+
+    for (i = 0; i < QUICKLISTS; i++) {
+        for (b = tc->bins[i].head; b != NULL; b = next) {
+            next = (Block *) b->next;
+            free_block(b);
+        }
+        tc->bins[i].head = NULL;
+        tc->bins[i].count = 0;
+        tc->bins[i].max = TCACHEMIN;
+        tc->bins[i].misses = tc->bins[i].overflows = 0;
+    }
+    tc->bytes = 0;
+}
+
+/* empty the caches of threads that haven't allocated or freed since the
+ * last look, or every cache after a memory limit was hit. a cache whose
+ * lock is held is in use, so it's skipped. */
+static void tcache_gc(void)
+{
+    TCache *tc;
+    bool all;
+
+    pthread_mutex_lock(&tcaches_lock);
+    all = atomic_exchange(&tcache_flush_all, false);
+    for (tc = tcaches; tc != NULL; tc = tc->next) {
+        if (atomic_flag_test_and_set_explicit(&tc->lock,
+                                              memory_order_acquire))
+            continue;
+        if ((all || tc->ops == tc->seen_ops) && tc->bytes != 0)
+            tcache_drain(tc);
+        tc->seen_ops = tc->ops;
+        TCACHEUNLOCK(tc);
+    }
+    pthread_mutex_unlock(&tcaches_lock);
+}
+
+// give an exiting thread's cache back
+static void tcache_exit(void *arg)
+{
+    TCache *tc = arg, **link;
+
+    my_tcache = NULL;
+    tcache_done = true;
+    pthread_mutex_lock(&tcaches_lock);
+    for (link = &tcaches; *link != tc; link = &(*link)->next)
+        ;
+    *link = tc->next;
+    TCACHELOCK(tc);
+    tcache_drain(tc);
+    pthread_mutex_unlock(&tcaches_lock);
+    munmap(tc, sizeof(TCache));
+}
+
+/* count bytes about to be taken from the system. returns false, with
+ * errno set, if that would take the footprint past the hard limit. */
+static bool footprint_grow(size_t bytes)
+{
+    if (hard_limit != 0 && stats.footprint + bytes > hard_limit) {
+        stats.limit_failures++;
+        // the thread caches may be holding what the caller needed
+        tcache_flush_all = true;
+        errno = ENOMEM;
+        return false;
+    }
+    stats.footprint += bytes;
+    if (stats.footprint > stats.footprint_peak)
+        stats.footprint_peak = stats.footprint;
+    return true;
+}
+
+/* give free memory back if growing by bytes would cross the soft limit.
+ * called before growing wherever no free block is being held on to, since
+ * blocks move and heaps shrink. returns true if anything was done. */
+static bool limit_soft(size_t bytes)
+{
+    if (soft_limit == 0 || stats.footprint + bytes <= soft_next)
+        return false;
+    limit_reclaim();
+    soft_next = stats.footprint + bytes + soft_limit / 16;
+    if (soft_next < soft_limit)
+        soft_next = soft_limit;
+    return true;
+}
+
+/* give back as much free memory as heap_lock allows: quick blocks and the
+ * calling thread's cache are freed, every heap's unsorted list is
+ * coalesced, its free pages purged and its end trimmed, cached large
+ * mappings are unmapped and free buddy blocks purged. other threads'
+ * caches are emptied by the next tcache_gc, once heap_lock is dropped. */
+static void limit_reclaim(void)
+{
+    Heap *h;
+    Block *b;
+    void *p;
+    size_t n;
+    int i, k, list_index;
+
+    stats.limit_reclaims++;
+    if (quick_on)
+        quick_flush();
+    /* tcache_gc may hold our cache's lock while it waits for heap_lock,
+     * so only try it. the blocks freed last, which it's likely to hold,
+     * are the ones at the end of the heap. */
+    if (my_tcache != NULL && my_tcache->bytes != 0 &&
+        !atomic_flag_test_and_set_explicit(&my_tcache->lock,
+                                           memory_order_acquire)) {
+        tcache_empty(my_tcache);
+        TCACHEUNLOCK(my_tcache);
+    }
+    for (i = -1; i < mapped_count; i++) {
+        h = i < 0 ? &main_heap : mapped_heaps[i];
+        while ((b = HEAD(h, 0)) != NULL) {
+            b = coalesce(h, b);
+            if (!ISALLOC(b))
+                free_list_remove(h, b);
+            free_list_insert(h, b, false);
+        }
+        for (list_index = find_list_index(2 * page_size);
+             list_index < LISTCOUNT; list_index++) {
+            for (b = HEAD(h, list_index); b != NULL; b = NEXT(h, b)) {
+                if (!ISPURGED(b) && SIZE(b) >= 2 * page_size)
+                    purge_block(h, b);
+            }
+        }
+        trim_heap(h);
+    }
+    for (i = 0; i < LARGEBINS; i++) {
+        while ((p = large_cache[i]) != NULL) {
+            large_cache[i] = *(void **) p;
+            munmap(p, (size_t) (i + 1) << page_shift);
+            stats.footprint -= (size_t) (i + 1) << page_shift;
+        }
+    }
+    large_cached = 0;
+    // top order blocks stop counting towards the footprint, as in buddy_free
+    for (k = 0; buddy_base != NULL && k < buddy_orders; k++) {
+        for (n = buddy_lists[k]; n != 0; n = buddy_links[n - 1].next) {
+            if (buddy_order[n - 1] == BUDDYPURGED)
+                continue;
+            madvise(BUDDYPTR(n - 1), page_size << k, MADV_DONTNEED);
+            if (k == buddy_orders - 1) {
+                buddy_order[n - 1] = BUDDYPURGED;
+                stats.footprint -= BUDDYMAX;
+            }
+        }
+    }
+    if (tcache_bytes != 0)
+        tcache_flush_all = true;
+}
+
+/* read a limit from file in the calling process's cgroup v2 directory,
+ * like memory.max, falling back to the root of the cgroup mount, which is
+ * where a container sees its own cgroup. returns 0 for no limit or if it
+ * can't be read. stdio would allocate, so plain system calls are used. */
+static size_t cgroup_limit(const char *file)
+{
+    char buf[PATH_MAX], path[PATH_MAX + 64], *rel = NULL, *end;
+    ssize_t n = -1;
+    size_t limit;
+    int fd;
+
+    if ((fd = open("/proc/self/cgroup", O_RDONLY | O_CLOEXEC)) >= 0) {
+        n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+    }
+    if (n > 0) {
+        // the v2 hierarchy is the line of the form 0::/path
+        buf[n] = '\0';
+        rel = strncmp(buf, "0::", 3) == 0 ? buf : strstr(buf, "\n0::");
+        if (rel != NULL) {
+            rel += (*rel == '\n') + 3;
+            if ((end = strchr(rel, '\n')) != NULL)
+                *end = '\0';
+        }
+    }
+    fd = -1;
+    if (rel != NULL) {
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/%s", rel, file);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        snprintf(path, sizeof(path), "/sys/fs/cgroup/%s", file);
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+            return 0;
+    }
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+    // "max" means no limit and fails to parse
+    limit = strtoull(buf, &end, 10);
+    return end != buf ? limit : 0;
+}
+
+/* ma_set_tag - count the calling thread's allocations under tag from now
+ * on. returns the previous tag, so a subsystem can restore it. */
+unsigned ma_set_tag(unsigned tag)
+{
+    unsigned old = my_tag;
+
+    if (tag >= MA_TAGS) {
+        errno = EINVAL;
+        return old;
+    }
+    if (tag != 0)
+        tags_used = true;
+    my_tag = tag;
+    return old;
+}
+
+// move heap block b's bytes from its tag's count to tag's
+static void tag_heap(Block *b, unsigned tag)
+{
+    if (TAG(b) != 0)
+        atomic_fetch_sub_explicit(&tag_bytes[TAG(b)], SIZE(b),
+                                  memory_order_relaxed);
+    if (tag != 0)
+        atomic_fetch_add_explicit(&tag_bytes[tag], SIZE(b),
+                                  memory_order_relaxed);
+    SETTAG(b, tag);
+}
+
+/* count the allocation at ptr under tag. heap blocks keep the tag in
+ * their header, and the rest in the metadata of their region or in their
+ * page map entry. called with heap_lock held. */
+static void tag_give(void *ptr, unsigned tag)
+{
+    SlabRun *run;
+    size_t *entry, size;
+
+    if (INSLAB(ptr)) {
+        run = &slab_runs[(ptr - slab_base) / SLABRUN];
+        run->tags[(ptr - slab_base) % SLABRUN / run->size] = tag;
+        size = run->size;
+    } else if (INBUDDY(ptr)) {
+        buddy_tag[BUDDYPAGE(ptr)] = tag;
+        size = page_size << (buddy_order[BUDDYPAGE(ptr)] - 1);
+    } else if (large_pages(ptr) != 0) {
+        entry = map_entry(ptr, false);
+        *entry = (*entry & ~TAGBITS) | (size_t) tag << TAGSHIFT;
+        size = (*entry & ~TAGBITS) << page_shift;
+    } else {
+        tag_heap(USERTOBLOCK(ptr), tag);
+        return;
+    }
+    atomic_fetch_add_explicit(&tag_bytes[tag], size, memory_order_relaxed);
+}
+
+/* stop counting the allocation at ptr under its tag, and return the tag.
+ * called with heap_lock held. */
+static unsigned tag_take(void *ptr)
+{
+    SlabRun *run;
+    size_t *entry, size;
+    unsigned tag;
+    uint8_t *slot;
+
+    if (INSLAB(ptr)) {
+        run = &slab_runs[(ptr - slab_base) / SLABRUN];
+        slot = &run->tags[(ptr - slab_base) % SLABRUN / run->size];
+        size = run->size;
+    } else if (INBUDDY(ptr)) {
+        slot = &buddy_tag[BUDDYPAGE(ptr)];
+        size = page_size << (buddy_order[BUDDYPAGE(ptr)] - 1);
+    } else if (large_pages(ptr) != 0) {
+        entry = map_entry(ptr, false);
+        tag = *entry >> TAGSHIFT;
+        *entry &= ~TAGBITS;
+        if (tag != 0)
+            atomic_fetch_sub_explicit(&tag_bytes[tag],
+                                      *entry << page_shift,
+                                      memory_order_relaxed);
+        return tag;
+    } else {
+        tag = TAG(USERTOBLOCK(ptr));
+        if (tag != 0)
+            tag_heap(USERTOBLOCK(ptr), 0);
+        return tag;
+    }
+    if ((tag = *slot) != 0) {
+        *slot = 0;
+        atomic_fetch_sub_explicit(&tag_bytes[tag], size,
+                                  memory_order_relaxed);
+    }
+    return tag;
+}
+
+/* snapshot buffer - grown with mremap, since malloc can't be called with
+ * heap_lock held */
+static struct ma_block *snap;
+static size_t snap_count, snap_len;
+
+// record a block in the snapshot. returns false if it couldn't grow.
+static bool snap_add(void *addr, size_t size, int kind, int state,
+                     unsigned tag)
+{
+    struct ma_block *blk;
+    size_t len;
+
+    if ((snap_count + 1) * sizeof(*snap) > snap_len) {
+        len = snap_len * 2;
+        if ((blk = mremap(snap, snap_len, len, MREMAP_MAYMOVE)) == MAP_FAILED)
+            return false;
+        snap = blk;
+        snap_len = len;
+    }
+    blk = &snap[snap_count++];
+    blk->addr = addr;
+    blk->size = size;
+    blk->kind = kind;
+    blk->state = state;
+    blk->tag = tag;
+    return true;
+}
+
+/* copy every block into a new snapshot, returning it and setting count to
+ * its length in blocks and len to its mapped size. thread caches are
+ * locked along with the heaps so their blocks can be told apart: they and
+ * unsorted blocks get the quick bit, in the header only, until the walk
+ * reaches them. returns NULL with errno set on failure. */
+static struct ma_block *heap_snapshot(size_t *count, size_t *len)
+{
+    struct ma_block *result = NULL;
+    TCache *tc;
+    Heap *h;
+    Block *b;
+    SlabRun *run;
+    size_t i, page, end, n, *entry;
+    void *p;
+    int j, k, state;
+    bool ok = true;
+
+    pthread_mutex_lock(&tcaches_lock);
+    for (tc = tcaches; tc != NULL; tc = tc->next)
+        TCACHELOCK(tc);
+    pthread_mutex_lock(&heap_lock);
+    if (malloc_init() < 0) {
+        ok = false;
+        goto out;
+    }
+    snap_count = 0;
+    snap_len = (size_t) 1 << 20;
+    snap = mmap(NULL, snap_len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (snap == MAP_FAILED) {
+        ok = false;
+        goto out;
+    }
+
+    for (tc = tcaches; tc != NULL; tc = tc->next)
+        for (i = 0; i < QUICKLISTS; i++)
+            for (b = tc->bins[i].head; b != NULL; b = (Block *) b->next)
+                MARKQUICK(b);
+    for (j = -1; j < mapped_count; j++) {
+        h = j < 0 ? &main_heap : mapped_heaps[j];
+        for (b = HEAD(h, 0); b != NULL; b = NEXT(h, b))
+            MARKQUICK(b);
+    }
+    for (j = -1; j < mapped_count; j++) {
+        h = j < 0 ? &main_heap : mapped_heaps[j];
+        for (b = (Block *) ((void *) h->prologue + WSIZE); b != h->epilogue;
+             b = NEXTRAW(b)) {
+            if (!ISALLOC(b)) {
+                state = ISQUICK(b) ? MA_UNSORTED : MA_FREE;
+                MARKUNQUICK(b);
+            } else {
+                state = ISQUICK(b) ? MA_QUICK : MA_ALLOCATED;
+            }
+            ok = ok && snap_add(b, SIZE(b), MA_KIND_HEAP, state,
+                                state == MA_ALLOCATED ? TAG(b) : 0);
+        }
+    }
+    for (tc = tcaches; tc != NULL; tc = tc->next)
+        for (i = 0; i < QUICKLISTS; i++)
+            for (b = tc->bins[i].head; b != NULL; b = (Block *) b->next)
+                MARKUNQUICK(b);
+
+    for (i = 0; i < slab_count; i++) {
+        run = &slab_runs[i];
+        p = slab_base + i * SLABRUN;
+        for (n = 0; n < SLABRUN / run->size; n++) {
+            state = run->free[n / 64] & 1ull << (n % 64) ? MA_FREE :
+                                                          MA_ALLOCATED;
+            ok = ok && snap_add(p + n * run->size, run->size, MA_KIND_SLAB,
+                                state, state == MA_FREE ? 0 : run->tags[n]);
+        }
+    }
+
+    /* an allocated buddy block has its order at its first page. a free
+     * one has the bit for its order set - the largest order is checked
+     * first, since a free block's first page is also the first page of
+     * every smaller order block inside it. */
+    for (page = 0, end = buddy_chunks * (BUDDYMAX >> page_shift);
+         page < end; page += (size_t) 1 << k) {
+        if (buddy_order[page] != 0 && buddy_order[page] != BUDDYPURGED) {
+            k = buddy_order[page] - 1;
+            ok = ok && snap_add(BUDDYPTR(page), page_size << k,
+                                MA_KIND_BUDDY, MA_ALLOCATED, buddy_tag[page]);
+            continue;
+        }
+        for (k = buddy_orders - 1; k > 0; k--)
+            if ((page & (((size_t) 1 << k) - 1)) == 0 && BUDDYBIT(k, page))
+                break;
+        ok = ok && snap_add(BUDDYPTR(page), page_size << k, MA_KIND_BUDDY,
+                            MA_FREE, 0);
+    }
+
+    // large allocations, and freed mappings kept for reuse
+    for (i = 0; page_map != NULL &&
+                i < (size_t) 1 << (MAPBITS - page_shift - MAPLEAFBITS); i++) {
+        if (page_map[i] == NULL)
+            continue;
+        for (n = 0; n < (size_t) 1 << MAPLEAFBITS; n++) {
+            entry = &page_map[i][n];
+            if (*entry == 0)
+                continue;
+            p = (void *) (((i << MAPLEAFBITS) + n) << page_shift);
+            ok = ok && snap_add(p, (*entry & ~TAGBITS) << page_shift,
+                                MA_KIND_LARGE, MA_ALLOCATED,
+                                *entry >> TAGSHIFT);
+        }
+    }
+    for (j = 0; j < LARGEBINS; j++)
+        for (p = large_cache[j]; p != NULL; p = *(void **) p)
+            ok = ok && snap_add(p, (size_t) (j + 1) << page_shift,
+                                MA_KIND_LARGE, MA_FREE, 0);
+
+    result = snap;
+    *count = snap_count;
+    *len = snap_len;
+out:
+    pthread_mutex_unlock(&heap_lock);
+    for (tc = tcaches; tc != NULL; tc = tc->next)
+        TCACHEUNLOCK(tc);
+    pthread_mutex_unlock(&tcaches_lock);
+    if (!ok) {
+        if (result != NULL)
+            munmap(result, *len);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return result;
+}
+
+/* ma_heap_visit - call fn on a snapshot of every block, taken with the
+ * allocator locked and visited with it unlocked */
+long ma_heap_visit(ma_visit_fn *fn, void *arg)
+{
+    struct ma_block *blocks;
+    size_t count, len, i;
+
+    if ((blocks = heap_snapshot(&count, &len)) == NULL)
+        return -1;
+    for (i = 0; i < count; i++)
+        fn(&blocks[i], arg);
+    munmap(blocks, len);
+    return count;
+}
+
+// write len bytes from buf to fd, retrying short writes
+static int write_all(int fd, const void *buf, size_t len)
+{
+    ssize_t n;
+
+    for (; len > 0; buf += n, len -= n) {
+        if ((n = write(fd, buf, len)) < 0) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* ma_heap_dump - write a snapshot of every block to fd as a header and
+ * fixed size records, converted a batch at a time on the stack */
+int ma_heap_dump(int fd)
+{
+    struct ma_dump_header hdr;
+    struct ma_dump_record recs[256];
+    struct ma_block *blocks;
+    size_t count, len, i, n = 0;
+    int err = 0;
+
+    if ((blocks = heap_snapshot(&count, &len)) == NULL)
+        return -1;
+    hdr.magic = MA_DUMP_MAGIC;
+    hdr.page_size = page_size;
+    hdr.count = count;
+    err = write_all(fd, &hdr, sizeof(hdr));
+    for (i = 0; i < count && err == 0; i++) {
+        recs[n].addr = (uintptr_t) blocks[i].addr;
+        recs[n].size = blocks[i].size;
+        recs[n].kind = blocks[i].kind;
+        recs[n].state = blocks[i].state;
+        recs[n].tag = blocks[i].tag;
+        recs[n].pad = 0;
+        if (++n == sizeof(recs) / sizeof(recs[0]) || i == count - 1) {
+            err = write_all(fd, recs, n * sizeof(recs[0]));
+            n = 0;
+        }
+    }
+    munmap(blocks, len);
+    return err;
+}
+
+/* bytes of allocated blocks, quick ones included, on the page at page,
+ * found by walking out from b, which must overlap it */
+static size_t page_live(Block *b, uintptr_t page)
+{
+    uintptr_t start, end;
+    size_t live = 0;
+
+    // back up to the block that overlaps the start of the page
+    while ((uintptr_t) b > page && SIZE(PREVFTR(b)) != 0)
+        b = PREVRAW(b);
+    for (; SIZE(b) != 0 && (uintptr_t) b < page + page_size; b = NEXTRAW(b)) {
+        if (!ISALLOC(b))
+            continue;
+        start = (uintptr_t) b > page ? (uintptr_t) b : page;
+        end = (uintptr_t) NEXTRAW(b) < page + page_size ?
+              (uintptr_t) NEXTRAW(b) : page + page_size;
+        live += end - start;
+    }
+    return live;
+}
+
+/* ma_should_move - if ptr is on a sparsely used heap page or slab run,
+ * allocate a block of the same size somewhere fuller. the new block comes
+ * from a page or run holding more than what would stay behind on ptr's,
+ * so a heap of equally sparse pages still packs together, and an object
+ * that's moved is never sent back. returns NULL if ptr should stay. */
+void *ma_should_move(void *ptr)
+{
+    Block *b, *f, *found = NULL;
+    Heap *h;
+    SlabRun *run, *other;
+    uint32_t *link;
+    uintptr_t page;
+    size_t r, n, live, seen = 0;
+    int list_index;
+    unsigned tag;
+    void *new = NULL;
+
+    if (ptr == NULL)
+        return NULL;
+    pthread_mutex_lock(&heap_lock);
+    if (INSLAB(ptr)) {
+        r = (ptr - slab_base) / SLABRUN;
+        run = &slab_runs[r];
+        n = SLABRUN / run->size;
+        if ((n - run->nfree) * MOVESPARSE >= n)
+            goto out;
+        for (link = &slab_partial[run->size / 16 - 1];
+             *link != 0 && seen++ < MOVESCAN;
+             link = &other->next) {
+            other = &slab_runs[*link - 1];
+            if (other != run && other->nfree <= run->nfree) {
+                new = slab_take(link);
+                break;
+            }
+        }
+    } else if (!INBUDDY(ptr) && large_pages(ptr) == 0) {
+        // buddy and large blocks have their pages to themselves
+        b = USERTOBLOCK(ptr);
+        page = ROUNDDOWN((uintptr_t) b, page_size);
+        if ((h = heap_of(b)) == NULL || SIZE(b) >= page_size ||
+            (live = page_live(b, page)) * MOVESPARSE >= page_size)
+            goto out;
+        // what stays behind on the page once b has gone
+        live = live > SIZE(b) ? live - SIZE(b) : 0;
+        /* sort some of the unsorted list, as find_block does, so that free
+         * blocks land on the lists that fit them and are searched below */
+        while ((f = HEAD(h, 0)) != NULL && seen++ < MOVESCAN) {
+            f = coalesce(h, f);
+            if (!ISALLOC(f))
+                free_list_remove(h, f);
+            free_list_insert(h, f, false);
+        }
+        for (list_index = find_list_index(SIZE(b)), seen = 0;
+             list_index < LISTCOUNT && found == NULL && seen < MOVESCAN;
+             list_index++) {
+            for (f = HEAD(h, list_index); f != NULL && seen < MOVESCAN;
+                 f = NEXT(h, f)) {
+                if (SIZE(f) < SIZE(b))
+                    continue;
+                seen++;
+                if (ROUNDDOWN((uintptr_t) f, page_size) != page &&
+                    page_live(f, ROUNDDOWN((uintptr_t) f, page_size)) >
+                    live) {
+                    found = f;
+                    break;
+                }
+            }
+        }
+        if (found != NULL) {
+            free_list_remove(h, found);
+            split(h, found, SIZE(b));
+            new = BLOCKTOUSER(found);
+        }
+    }
+    // the object keeps its tag in its new place
+    if (new != NULL && tags_used && (tag = tag_take(ptr)) != 0) {
+        tag_give(ptr, tag);
+        tag_give(new, tag);
+    }
+out:
+    pthread_mutex_unlock(&heap_lock);
+    return new;
+}
+
+/* ma_malloc_cold - allocate size bytes in the cold heap, at any size, so
+ * the pages it's on only ever hold cold data */
+void *ma_malloc_cold(size_t size)
+{
+    void *userptr = NULL;
+
+    if (size == 0)
+        return NULL;
+    if (size > ALIGN(BLOCKSIZE(size))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_mutex_lock(&heap_lock);
+    if (malloc_init() == 0 &&
+        (cold_heap.limit != NULL || heap_map(&cold_heap) == 0)) {
+        // paging out part of a huge page would split it anyway
+        if (cold_heap.top == (void *) cold_heap.prologue + page_size)
+            madvise(cold_heap.prologue, HEAPRESERVE, MADV_NOHUGEPAGE);
+        userptr = malloc_block(&cold_heap, ALIGN(BLOCKSIZE(size)));
+        if (my_tag != 0 && userptr != NULL)
+            tag_give(userptr, my_tag);
+    }
+    pthread_mutex_unlock(&heap_lock);
+    if (tcache_flush_all)
+        tcache_gc();
+    return userptr;
+}
+
+/* ma_mark_cold - advise the kernel that the whole pages inside ptr's
+ * allocation, or the whole cold heap if ptr is NULL, won't be used soon.
+ * MADV_COLD makes them the first to be reclaimed; MADV_PAGEOUT reclaims
+ * them now. the advice is given after unlocking, since paging out can
+ * take a while, and it never discards data, so it's harmless if the
+ * memory has been reused by then. */
+int ma_mark_cold(void *ptr, int pageout)
+{
+    uintptr_t start = 0, end = 0;
+    Block *b;
+    size_t pages;
+
+    pthread_mutex_lock(&heap_lock);
+    if (ptr == NULL) {
+        if (cold_heap.limit != NULL) {
+            start = (uintptr_t) cold_heap.prologue;
+            end = (uintptr_t) cold_heap.top;
+        }
+    } else if (INSLAB(ptr)) {
+        start = (uintptr_t) ptr;
+        end = start + slab_runs[(ptr - slab_base) / SLABRUN].size;
+    } else if (INBUDDY(ptr)) {
+        start = (uintptr_t) ptr;
+        end = start + (page_size << (buddy_order[BUDDYPAGE(ptr)] - 1));
+    } else if ((pages = large_pages(ptr)) != 0) {
+        start = (uintptr_t) ptr;
+        end = start + (pages << page_shift);
+    } else {
+        // the footer is touched when a neighbor is freed
+        b = USERTOBLOCK(ptr);
+        start = (uintptr_t) ptr;
+        end = (uintptr_t) GETFTR(b);
+    }
+    pthread_mutex_unlock(&heap_lock);
+
+    start = ROUNDUP(start, page_size);
+    end = ROUNDDOWN(end, page_size);
+    if (start >= end)
+        return 0;
+    return madvise((void *) start, end - start,
+                   pageout ? MADV_PAGEOUT : MADV_COLD);
+}
@@ -0,0 +1,76 @@
+/*
+ * async_free - everything a thread hands to ma_free_async, or frees with
+ * ma_async_free_mode on, should be freed by the time ma_async_flush
+ * returns, ring overflows included. each thread tags its allocations so
+ * its live bytes can be read back from ma_get_stats.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "../microalloc.h"
+
+#define THREADS          4
+#define COUNT            50000
+#define SIZE             100
+
+static struct ma_stats st;
+static pthread_mutex_t st_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t tag_bytes(unsigned tag)
+{
+    size_t bytes;
+
+    pthread_mutex_lock(&st_lock);
+    ma_get_stats(&st);
+    bytes = st.tag_bytes[tag];
+    pthread_mutex_unlock(&st_lock);
+    return bytes;
+}
+
+static void *run(void *arg)
+{
+    static __thread void *objects[COUNT];
+    unsigned tag = (unsigned) (uintptr_t) arg;
+    int i, round;
+
+    ma_set_tag(tag);
+    for (round = 0; round < 2; round++) {
+        for (i = 0; i < COUNT; i++)
+            objects[i] = malloc(SIZE);
+        if (tag_bytes(tag) < (size_t) COUNT * SIZE) {
+            fprintf(stderr, "async_free: thread %u's allocations weren't "
+                    "counted\n", tag);
+            exit(1);
+        }
+        // the first round queues explicitly, the second through free
+        ma_async_free_mode(round);
+        for (i = 0; i < COUNT; i++) {
+            if (round == 0)
+                ma_free_async(objects[i]);
+            else
+                free(objects[i]);
+        }
+        ma_async_flush();
+        if (tag_bytes(tag) != 0) {
+            fprintf(stderr, "async_free: thread %u has %zu bytes live after "
+                    "flushing round %d\n", tag, tag_bytes(tag), round);
+            exit(1);
+        }
+    }
+    ma_async_free_mode(0);
+    return NULL;
+}
+
+int main(void)
+{
+    pthread_t threads[THREADS];
+    uintptr_t i;
+
+    for (i = 0; i < THREADS; i++)
+        pthread_create(&threads[i], NULL, run, (void *) (i + 1));
+    for (i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+    return 0;
+}
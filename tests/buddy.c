@@ -0,0 +1,90 @@
+/*
+ * buddy - mid-size requests should get blocks of a power of two pages
+ * aligned to their size, freed blocks should merge back into bigger
+ * ones, and a forked child that frees inherited blocks shouldn't copy
+ * their pages.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "../microalloc.h"
+
+#define COUNT            256
+#define TOP              ((size_t) 1 << 20)
+
+static char *blocks[COUNT];
+
+// private dirty bytes across the whole process
+static size_t private_dirty(void)
+{
+    char line[256];
+    size_t kb, total = 0;
+    FILE *f;
+
+    if ((f = fopen("/proc/self/smaps_rollup", "r")) == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), f) != NULL)
+        if (sscanf(line, "Private_Dirty: %zu kB", &kb) == 1)
+            total += kb << 10;
+    fclose(f);
+    return total;
+}
+
+int main(void)
+{
+    size_t page = sysconf(_SC_PAGESIZE), before;
+    uintptr_t low = UINTPTR_MAX, high = 0;
+    char *p;
+    int i, status;
+    pid_t pid;
+
+    // three pages take a block of four, aligned to four
+    p = malloc(3 * page);
+    if ((uintptr_t) p % (4 * page) != 0) {
+        fprintf(stderr, "buddy: a 3 page block at %p isn't aligned to 4 "
+                "pages\n", (void *) p);
+        return 1;
+    }
+    free(p);
+
+    for (i = 0; i < COUNT; i++) {
+        blocks[i] = malloc(page);
+        memset(blocks[i], 1, page);
+        if ((uintptr_t) blocks[i] < low)
+            low = (uintptr_t) blocks[i];
+        if ((uintptr_t) blocks[i] > high)
+            high = (uintptr_t) blocks[i];
+    }
+
+    // a child freeing them all copies little more than its stack
+    if ((pid = fork()) == 0) {
+        before = private_dirty();
+        for (i = 0; i < COUNT; i++)
+            free(blocks[i]);
+        _exit(private_dirty() - before > COUNT * page / 8);
+    }
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "buddy: a forked child copied the pages of the "
+                "blocks it freed\n");
+        return 1;
+    }
+
+    // once they're all free, they merge into blocks of the top order
+    for (i = 0; i < COUNT; i++)
+        free(blocks[i]);
+    p = malloc(TOP);
+    if ((uintptr_t) p % TOP != 0 || (uintptr_t) p > high ||
+        (uintptr_t) p + TOP <= low) {
+        fprintf(stderr, "buddy: a 1 MB block at %p didn't reuse the merged "
+                "space at %#lx-%#lx\n", (void *) p, (unsigned long) low,
+                (unsigned long) high + page);
+        return 1;
+    }
+    free(p);
+    return 0;
+}
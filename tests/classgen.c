@@ -0,0 +1,148 @@
+/*
+ * classgen - tools/classgen should start a list at each popular size, so
+ * a search for it never meets a smaller block first, and keep every list
+ * within its spread. it's fed a histogram, and a heap dump of this
+ * process whose allocations it has to count. run it from the top of the
+ * tree after make classgen.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../microalloc.h"
+
+#define LIMIT            4096
+#define SLOTS            (LIMIT / 8 + 1)
+#define COUNT            2000
+#define BLOCKSIZE(u)     (((u) + 16 + 15) & ~(size_t) 7)
+
+// request sizes that are far more common than the rest
+static const size_t popular[] = {100, 1000, 2500};
+
+static unsigned table[SLOTS], floors[SLOTS];
+static int nfloors;
+// how many allocations classgen says it read
+static double allocations;
+
+/* run classgen on input and read the class table and list floors from
+ * what it writes */
+static int classgen(const char *input)
+{
+    char out[] = "/tmp/classgen_outXXXXXX", cmd[256], line[256], *p, *end;
+    int fd, n = 0, which = 0;
+    FILE *f;
+
+    if ((fd = mkstemp(out)) < 0)
+        return -1;
+    close(fd);
+    snprintf(cmd, sizeof(cmd), "tools/classgen -o %s %s 2>/dev/null", out,
+             input);
+    if (system(cmd) != 0 || (f = fopen(out, "r")) == NULL) {
+        unlink(out);
+        return -1;
+    }
+    nfloors = 0;
+    allocations = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (allocations == 0 && strstr(line, " allocations.") != NULL)
+            allocations = strtod(line + 3, NULL);
+        else if (strstr(line, "class_table[") != NULL)
+            which = 1, n = 0;
+        else if (strstr(line, "class_floor[") != NULL)
+            which = 2;
+        else if (line[0] == '}')
+            which = 0;
+        else if (which != 0)
+            for (p = line; ; p = end) {
+                unsigned v = strtoul(p, &end, 10);
+                if (end == p)
+                    break;
+                if (which == 1 && n < SLOTS)
+                    table[n++] = v;
+                else if (which == 2 && nfloors < SLOTS)
+                    floors[nfloors++] = v;
+                end += strspn(end, ", ");
+            }
+    }
+    fclose(f);
+    unlink(out);
+    return n == SLOTS ? 0 : -1;
+}
+
+// check the classes for a workload whose popular sizes are sizes
+static int check(const char *what, const size_t *sizes, int count)
+{
+    size_t slot;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        slot = BLOCKSIZE(sizes[i]) / 8;
+        if (table[slot - 1] == table[slot]) {
+            fprintf(stderr, "classgen: %s: %zu byte requests share a list "
+                    "with smaller blocks\n", what, sizes[i]);
+            return -1;
+        }
+    }
+    // floors[0] is the unsorted list's
+    for (i = 1; i + 1 < nfloors; i++) {
+        if ((floors[i + 1] - 8) * 8 > floors[i] * 9) {
+            fprintf(stderr, "classgen: %s: a list spans %u to %u bytes\n",
+                    what, floors[i], floors[i + 1] - 8);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(void)
+{
+    char path[] = "/tmp/classgen_inXXXXXX";
+    char dump[] = "/tmp/classgen_dumpXXXXXX";
+    static void *objects[COUNT];
+    size_t size;
+    FILE *in;
+    int fd, i;
+
+    // every size once, and the popular ones a million times
+    if ((fd = mkstemp(path)) < 0 || (in = fdopen(fd, "w")) == NULL) {
+        perror("classgen: histogram");
+        return 1;
+    }
+    for (size = 1; size < LIMIT - 32; size++)
+        fprintf(in, "%zu 1\n", size);
+    for (i = 0; i < 3; i++)
+        fprintf(in, "%zu 1000000\n", popular[i]);
+    fclose(in);
+    if (classgen(path) < 0) {
+        fprintf(stderr, "classgen: tools/classgen failed on a histogram\n");
+        unlink(path);
+        return 1;
+    }
+    unlink(path);
+    if (check("histogram", popular, 3) < 0)
+        return 1;
+
+    // a dump of this process, whose heap is mostly these
+    for (i = 0; i < COUNT; i++)
+        objects[i] = malloc(popular[i % 3]);
+    if ((fd = mkstemp(dump)) < 0 || ma_heap_dump(fd) < 0) {
+        perror("classgen: dump");
+        return 1;
+    }
+    close(fd);
+    if (classgen(dump) < 0) {
+        fprintf(stderr, "classgen: tools/classgen failed on a dump\n");
+        unlink(dump);
+        return 1;
+    }
+    unlink(dump);
+    if (allocations < COUNT) {
+        fprintf(stderr, "classgen: only %.0f of %d allocations counted in a "
+                "dump\n", allocations, COUNT);
+        return 1;
+    }
+    for (i = 0; i < COUNT; i++)
+        free(objects[i]);
+    return 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * cold_heap - ma_malloc_cold should place objects of any size together
+ * in a heap of their own that is never backed by huge pages, even with
+ * MICROALLOC_THP=1, and ma_mark_cold should succeed without losing data.
+ * free and realloc should work on cold objects as usual.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "../microalloc.h"
+
+#define SMALL            100
+#define BIG              (1 << 20)
+
+/* the start of the mapping holding p, and whether it's kept off huge
+ * pages, from /proc/self/smaps */
+static uintptr_t mapping(void *p, int *nohuge)
+{
+    char line[256];
+    unsigned long start, end, found = 0;
+    int in = 0;
+    FILE *smaps;
+
+    *nohuge = 0;
+    if ((smaps = fopen("/proc/self/smaps", "r")) == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), smaps) != NULL) {
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            if ((in = (uintptr_t) p >= start && (uintptr_t) p < end))
+                found = start;
+        } else if (in && strncmp(line, "VmFlags:", 8) == 0) {
+            *nohuge = strstr(line, " nh") != NULL;
+        }
+    }
+    fclose(smaps);
+    return found;
+}
+
+int main(void)
+{
+    struct ma_stats before, after;
+    char *small, *big, *hot;
+    int nohuge;
+
+    hot = malloc(SMALL);
+    small = ma_malloc_cold(SMALL);
+    big = ma_malloc_cold(BIG);
+    memset(small, 1, SMALL);
+    memset(big, 2, BIG);
+    if (mapping(small, &nohuge) != mapping(big, &nohuge) ||
+        mapping(small, &nohuge) == mapping(hot, &nohuge)) {
+        fprintf(stderr, "cold_heap: cold objects at %p and %p aren't "
+                "together, apart from %p\n", (void *) small, (void *) big,
+                (void *) hot);
+        return 1;
+    }
+    mapping(big, &nohuge);
+    if (!nohuge) {
+        fprintf(stderr, "cold_heap: the cold heap may use huge pages\n");
+        return 1;
+    }
+
+    if (ma_mark_cold(big, 0) < 0 || ma_mark_cold(big, 1) < 0 ||
+        ma_mark_cold(NULL, 0) < 0) {
+        perror("cold_heap: ma_mark_cold");
+        return 1;
+    }
+    if (big[0] != 2 || big[BIG - 1] != 2 || small[0] != 1) {
+        fprintf(stderr, "cold_heap: marking objects cold lost their "
+                "contents\n");
+        return 1;
+    }
+
+    if ((small = realloc(small, 2 * SMALL)) == NULL || small[0] != 1 ||
+        small[SMALL - 1] != 1) {
+        fprintf(stderr, "cold_heap: realloc lost a cold object's "
+                "contents\n");
+        return 1;
+    }
+    free(big);
+    ma_get_stats(&before);
+    big = ma_malloc_cold(BIG);
+    ma_get_stats(&after);
+    if (after.footprint > before.footprint) {
+        fprintf(stderr, "cold_heap: a freed cold object wasn't reused\n");
+        return 1;
+    }
+    free(big);
+    free(small);
+    free(hot);
+    return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * cow_slab - with MICROALLOC_COW=1, a forked child that frees the small
+ * objects it inherited should copy only the slab's metadata pages, not
+ * the pages the objects are on.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "../microalloc.h"
+
+#define COUNT            100000
+#define SIZE             64
+
+static void *objects[COUNT];
+
+// private dirty bytes across the whole process
+static size_t private_dirty(void)
+{
+    char line[256];
+    size_t kb, total = 0;
+    FILE *f;
+
+    if ((f = fopen("/proc/self/smaps_rollup", "r")) == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), f) != NULL)
+        if (sscanf(line, "Private_Dirty: %zu kB", &kb) == 1)
+            total += kb << 10;
+    fclose(f);
+    return total;
+}
+
+int main(void)
+{
+    size_t before, copied;
+    int i, status;
+    pid_t pid;
+
+    for (i = 0; i < COUNT; i++) {
+        objects[i] = malloc(SIZE);
+        memset(objects[i], 1, SIZE);
+    }
+    if ((pid = fork()) == 0) {
+        before = private_dirty();
+        for (i = 0; i < COUNT; i++)
+            free(objects[i]);
+        copied = private_dirty() - before;
+        if (copied > (size_t) COUNT * SIZE / 8) {
+            fprintf(stderr, "cow_slab: freeing %d bytes copied %zu\n",
+                    COUNT * SIZE, copied);
+            _exit(1);
+        }
+        _exit(0);
+    }
+    waitpid(pid, &status, 0);
+    for (i = 0; i < COUNT; i++)
+        free(objects[i]);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
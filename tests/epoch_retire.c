@@ -0,0 +1,104 @@
+/*
+ * epoch_retire - objects passed to ma_retire should stay intact while a
+ * reader that could have seen them is inside its critical section, and
+ * be freed by ma_epoch_reclaim once it leaves. they're tagged so their
+ * live bytes can be read back from ma_get_stats.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "../microalloc.h"
+
+#define COUNT            10000
+#define SIZE             64
+#define TAG              7
+
+static void *objects[COUNT];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int entered, leave;
+
+// enter a critical section and stay in it until told to leave
+static void *reader(void *arg)
+{
+    ma_epoch_enter();
+    pthread_mutex_lock(&lock);
+    entered = 1;
+    pthread_cond_broadcast(&cond);
+    while (!leave)
+        pthread_cond_wait(&cond, &lock);
+    pthread_mutex_unlock(&lock);
+    ma_epoch_exit();
+    return arg;
+}
+
+static size_t live(void)
+{
+    static struct ma_stats st;
+
+    ma_get_stats(&st);
+    return st.tag_bytes[TAG];
+}
+
+int main(void)
+{
+    pthread_t thread;
+    void *churn[64];
+    size_t retired;
+    int i, j;
+
+    ma_set_tag(TAG);
+    for (i = 0; i < COUNT; i++) {
+        objects[i] = malloc(SIZE);
+        memset(objects[i], 0x5a, SIZE);
+    }
+    ma_set_tag(0);
+    // tags count whole blocks, so this is a little more than COUNT * SIZE
+    retired = live();
+    pthread_create(&thread, NULL, reader, NULL);
+    pthread_mutex_lock(&lock);
+    while (!entered)
+        pthread_cond_wait(&cond, &lock);
+    pthread_mutex_unlock(&lock);
+
+    for (i = 0; i < COUNT; i++)
+        ma_retire(objects[i]);
+    // nothing may be freed, however hard the allocator is pushed
+    for (i = 0; i < 100; i++) {
+        ma_epoch_reclaim();
+        for (j = 0; j < 64; j++)
+            churn[j] = malloc(SIZE);
+        for (j = 0; j < 64; j++)
+            free(churn[j]);
+    }
+    if (live() != retired) {
+        fprintf(stderr, "epoch_retire: %zu of %zu retired bytes freed under "
+                "a reader\n", retired - live(), retired);
+        return 1;
+    }
+    for (i = 0; i < COUNT; i++) {
+        if (((unsigned char *) objects[i])[0] != 0x5a ||
+            ((unsigned char *) objects[i])[SIZE - 1] != 0x5a) {
+            fprintf(stderr, "epoch_retire: object %d was reused under a "
+                    "reader\n", i);
+            return 1;
+        }
+    }
+
+    pthread_mutex_lock(&lock);
+    leave = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+    // each call advances the epoch by at most one
+    for (i = 0; i < 3; i++)
+        ma_epoch_reclaim();
+    if (live() != 0) {
+        fprintf(stderr, "epoch_retire: %zu retired bytes left after the "
+                "reader exited\n", live());
+        return 1;
+    }
+    return 0;
+}
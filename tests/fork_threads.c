@@ -0,0 +1,102 @@
+/*
+ * fork_threads - fork while other threads allocate, free through the
+ * helper thread and retire objects, then check that the child can use
+ * every part of the allocator and reuses what it frees.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "../microalloc.h"
+
+#define THREADS          6
+#define FORKS            100
+#define COUNT            20000
+#define SIZE             1000
+
+static atomic_bool done;
+static void *objects[COUNT];
+
+static void *churn(void *arg)
+{
+    unsigned seed = (unsigned) (long) arg;
+    void *live[64] = {0};
+    int i;
+
+    while (!atomic_load(&done)) {
+        i = rand_r(&seed) % 64;
+        if ((long) arg % 2 != 0)
+            ma_free_async(live[i]);
+        else
+            free(live[i]);
+        live[i] = malloc(rand_r(&seed) % 2000 + 1);
+        if ((long) arg % 3 == 0) {
+            ma_epoch_enter();
+            ma_epoch_exit();
+            ma_retire(malloc(32));
+        }
+    }
+    return NULL;
+}
+
+/* the child's work - returns its exit status. it allocates and frees,
+ * partly through the helper thread, twice over, and the second round has
+ * to fit in the memory the first one freed. */
+static int child(void)
+{
+    struct ma_stats st;
+    size_t peak = 0;
+    int round, i;
+
+    for (round = 0; round < 2; round++) {
+        for (i = 0; i < COUNT; i++) {
+            objects[i] = malloc(SIZE);
+            memset(objects[i], 7, SIZE);
+        }
+        ma_get_stats(&st);
+        if (round == 0)
+            peak = st.footprint;
+        else if (st.footprint > peak + COUNT * SIZE / 4)
+            return 2;
+        for (i = 0; i < COUNT; i++) {
+            if (i % 4 == 1)
+                ma_free_async(objects[i]);
+            else
+                free(objects[i]);
+        }
+        ma_retire(malloc(40));
+        ma_epoch_reclaim();
+        ma_async_flush();
+    }
+    return 0;
+}
+
+int main(void)
+{
+    pthread_t threads[THREADS];
+    int i, status, bad = 0;
+    pid_t pid;
+
+    for (i = 0; i < THREADS; i++)
+        pthread_create(&threads[i], NULL, churn, (void *) (long) i);
+    for (i = 0; i < FORKS; i++) {
+        if ((pid = fork()) == 0)
+            _exit(child());
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "fork_threads: child %d failed, status %#x\n",
+                    i, status);
+            bad = 1;
+            break;
+        }
+    }
+    atomic_store(&done, true);
+    for (i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+    return bad;
+}
@@ -0,0 +1,114 @@
+/*
+ * heap_visit - the heap walker should report every live allocation as an
+ * allocated block of the right kind and tag, a freed one as not
+ * allocated, let its callback allocate, and write the same blocks to a
+ * dump. run it with MICROALLOC_TCACHE=0 and MICROALLOC_QUICK=0, so a freed
+ * block is back on the heap.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../microalloc.h"
+
+#define KINDS            3
+#define TAG              5
+
+// a heap block, a buddy block and a large mapping
+static const size_t sizes[KINDS] = {200, 64 << 10, 2 << 20};
+static const int kinds[KINDS] = {MA_KIND_HEAP, MA_KIND_BUDDY, MA_KIND_LARGE};
+static char *objects[KINDS], *freed, *pin;
+static int found[KINDS], freed_state = -1;
+static long visited;
+
+static int holds(const void *addr, size_t size, const char *p)
+{
+    return p >= (const char *) addr && p < (const char *) addr + size;
+}
+
+static void visit(const struct ma_block *b, void *arg)
+{
+    int i;
+
+    for (i = 0; i < KINDS; i++) {
+        if (holds(b->addr, b->size, objects[i]) &&
+            b->kind == kinds[i] && b->state == MA_ALLOCATED &&
+            b->tag == TAG && b->size >= sizes[i])
+            found[i]++;
+    }
+    if (holds(b->addr, b->size, freed))
+        freed_state = b->state;
+    // the callback runs unlocked, so it may allocate
+    free(malloc(100));
+    visited++;
+}
+
+int main(void)
+{
+    struct ma_dump_header hdr;
+    struct ma_dump_record rec;
+    FILE *dump;
+    long count, i;
+    int j, dumped[KINDS] = {0};
+
+    ma_set_tag(TAG);
+    for (j = 0; j < KINDS; j++)
+        objects[j] = malloc(sizes[j]);
+    ma_set_tag(0);
+    freed = malloc(300);
+    // keeps the freed block from joining the end of the heap
+    pin = malloc(300);
+    free(freed);
+
+    count = ma_heap_visit(visit, NULL);
+    if (count <= 0 || count != visited) {
+        fprintf(stderr, "heap_visit: returned %ld after %ld visits\n",
+                count, visited);
+        return 1;
+    }
+    for (j = 0; j < KINDS; j++) {
+        if (found[j] != 1) {
+            fprintf(stderr, "heap_visit: block %d was reported %d times\n",
+                    j, found[j]);
+            return 1;
+        }
+    }
+    if (freed_state == MA_ALLOCATED || freed_state == -1) {
+        fprintf(stderr, "heap_visit: a freed block wasn't reported free\n");
+        return 1;
+    }
+
+    if ((dump = tmpfile()) == NULL || ma_heap_dump(fileno(dump)) < 0) {
+        perror("heap_visit: ma_heap_dump");
+        return 1;
+    }
+    rewind(dump);
+    if (fread(&hdr, sizeof(hdr), 1, dump) != 1 ||
+        hdr.magic != MA_DUMP_MAGIC ||
+        hdr.page_size != (uint64_t) sysconf(_SC_PAGESIZE)) {
+        fprintf(stderr, "heap_visit: bad dump header\n");
+        return 1;
+    }
+    for (i = 0; i < (long) hdr.count; i++) {
+        if (fread(&rec, sizeof(rec), 1, dump) != 1) {
+            fprintf(stderr, "heap_visit: dump ends after %ld of %llu "
+                    "records\n", i, (unsigned long long) hdr.count);
+            return 1;
+        }
+        for (j = 0; j < KINDS; j++)
+            if (holds((void *) (uintptr_t) rec.addr, rec.size, objects[j]) &&
+                rec.kind == kinds[j] && rec.tag == TAG)
+                dumped[j]++;
+    }
+    for (j = 0; j < KINDS; j++) {
+        if (dumped[j] != 1) {
+            fprintf(stderr, "heap_visit: block %d was dumped %d times\n", j,
+                    dumped[j]);
+            return 1;
+        }
+    }
+    fclose(dump);
+    free(pin);
+    return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * hp_packing - with MICROALLOC_THP=1, allocations should fill holes on the
+ * fullest huge page before touching a mostly empty one, so the empty one
+ * can be given back whole. run it with MICROALLOC_TCACHE=0 and
+ * MICROALLOC_QUICK=0, so frees reach the heap.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "../microalloc.h"
+
+#define HUGEPAGE         ((uintptr_t) 2 << 20)
+#define SIZE             1000
+#define COUNT            (int) (3 * HUGEPAGE / SIZE)
+// holes made on the dense page, one in every HOLE objects
+#define HOLE             10
+
+static void *objects[COUNT];
+
+static uintptr_t hp(void *p)
+{
+    return (uintptr_t) p / HUGEPAGE;
+}
+
+int main(void)
+{
+    static void *refill[COUNT];
+    uintptr_t dense, sparse;
+    int i, holes = 0, on_dense = 0;
+
+    for (i = 0; i < COUNT; i++)
+        objects[i] = malloc(SIZE);
+    // the first whole huge page is the dense one, the next the sparse one
+    for (i = 0; hp(objects[i]) == hp(objects[0]); i++)
+        ;
+    dense = hp(objects[i]);
+    for (; hp(objects[i]) == dense; i++)
+        ;
+    sparse = hp(objects[i]);
+
+    // holes on the dense page first, so they're older on the free lists
+    for (i = 0; i < COUNT; i++) {
+        if (hp(objects[i]) == dense && i % HOLE == 0) {
+            free(objects[i]);
+            objects[i] = NULL;
+            holes++;
+        }
+    }
+    // then all but every 50th object on the sparse page
+    for (i = 0; i < COUNT; i++) {
+        if (hp(objects[i]) == sparse && i % 50 != 0) {
+            free(objects[i]);
+            objects[i] = NULL;
+        }
+    }
+
+    for (i = 0; i < holes; i++) {
+        refill[i] = malloc(SIZE);
+        if (hp(refill[i]) == dense)
+            on_dense++;
+    }
+    if (on_dense * 10 < holes * 9) {
+        fprintf(stderr, "hp_packing: only %d of %d allocations went to the "
+                "dense huge page\n", on_dense, holes);
+        return 1;
+    }
+    for (i = 0; i < holes; i++)
+        free(refill[i]);
+    for (i = 0; i < COUNT; i++)
+        free(objects[i]);
+    return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * large_blocks - requests from MICROALLOC_LARGE up should be page aligned
+ * and usable to the end of their last page, keep their contents through
+ * realloc in both directions, reuse small freed mappings, and give big
+ * ones back. run it with MICROALLOC_BUDDY=0, so every such request is a
+ * mapping of its own.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "../microalloc.h"
+
+#define SMALL            5000
+#define BIG              (2 << 20)
+#define HUGE             (64 << 20)
+
+static int fail(const char *what)
+{
+    fprintf(stderr, "large_blocks: %s\n", what);
+    return 1;
+}
+
+int main(void)
+{
+    struct ma_stats st;
+    size_t page = sysconf(_SC_PAGESIZE), footprint;
+    char *p, *q;
+    void *aligned;
+
+    p = malloc(SMALL);
+    if (p == NULL || (uintptr_t) p % page != 0)
+        return fail("a small large block isn't page aligned");
+    // the rest of the last page belongs to the caller too
+    memset(p, 1, (SMALL + page - 1) / page * page);
+    free(p);
+    if ((q = malloc(SMALL)) != p)
+        return fail("a freed small mapping wasn't reused");
+    free(q);
+
+    if ((p = malloc(BIG)) == NULL || (uintptr_t) p % page != 0)
+        return fail("a big block isn't page aligned");
+    memset(p, 2, BIG);
+    ma_get_stats(&st);
+    footprint = st.footprint;
+    if ((p = realloc(p, HUGE)) == NULL || (uintptr_t) p % page != 0 ||
+        p[0] != 2 || p[BIG - 1] != 2)
+        return fail("growing a big block lost its contents");
+    memset(p + BIG, 3, HUGE - BIG);
+    if ((p = realloc(p, 100)) == NULL || p[0] != 2 || p[99] != 2)
+        return fail("shrinking a huge block lost its contents");
+    ma_get_stats(&st);
+    if (st.footprint > footprint)
+        return fail("a huge block's pages weren't given back when it "
+                    "shrank");
+    free(p);
+
+    if (posix_memalign(&aligned, 64 << 10, 100 << 10) != 0 ||
+        (uintptr_t) aligned % (64 << 10) != 0)
+        return fail("posix_memalign ignored a 64k alignment");
+    memset(aligned, 4, 100 << 10);
+    free(aligned);
+    return 0;
+}
@@ -0,0 +1,85 @@
+/*
+ * lifetime_report - with MICROALLOC_PROFILE_LIFETIME=1, ma_lifetime_report
+ * should call a site whose objects are freed right away a region
+ * candidate, and a site whose objects are never freed immortal.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../microalloc.h"
+
+#define COUNT            20000
+#define SIZE             64
+
+static void *kept[COUNT];
+
+static __attribute__((noinline)) void *keep(void)
+{
+    return malloc(SIZE);
+}
+
+static __attribute__((noinline)) void *drop(void)
+{
+    return malloc(SIZE);
+}
+
+/* the report's line for the site inside fn - the first one past its
+ * start, since the other function's site may follow it - or NULL */
+static const char *verdict(FILE *report, void *fn, char *line, size_t len)
+{
+    unsigned long addr, best = 0;
+    long at = -1;
+
+    rewind(report);
+    while (fgets(line, len, report) != NULL) {
+        if (sscanf(line, "%lx", &addr) == 1 && addr > (unsigned long) fn &&
+            addr < (unsigned long) fn + 256 && (best == 0 || addr < best)) {
+            best = addr;
+            at = ftell(report) - strlen(line);
+        }
+    }
+    if (at < 0 || fseek(report, at, SEEK_SET) != 0)
+        return NULL;
+    return fgets(line, len, report);
+}
+
+int main(void)
+{
+    char line[256];
+    const char *v;
+    FILE *report;
+    int i;
+
+    for (i = 0; i < COUNT; i++) {
+        // three calls a round, so sampling every 64th call sees both sites
+        kept[i] = keep();
+        free(drop());
+        free(drop());
+    }
+    if ((report = tmpfile()) == NULL) {
+        perror("lifetime_report: tmpfile");
+        return 1;
+    }
+    ma_lifetime_report(report);
+    fflush(report);
+
+    if ((v = verdict(report, drop, line, sizeof(line))) == NULL ||
+        strstr(v, "region candidate") == NULL) {
+        fprintf(stderr, "lifetime_report: short lived site: %s",
+                v == NULL ? "missing\n" : v);
+        return 1;
+    }
+    if ((v = verdict(report, keep, line, sizeof(line))) == NULL ||
+        strstr(v, "immortal") == NULL) {
+        fprintf(stderr, "lifetime_report: immortal site: %s",
+                v == NULL ? "missing\n" : v);
+        return 1;
+    }
+    fclose(report);
+    // the report printed at exit isn't worth showing
+    dup2(open("/dev/null", O_WRONLY), 2);
+    return 0;
+}
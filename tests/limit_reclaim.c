@@ -0,0 +1,41 @@
+/*
+ * limit_reclaim - after everything is freed, memory must go back to the
+ * system when the soft limit is crossed, so that a later allocation fits
+ * under the hard limit. run it with MICROALLOC_SOFT_LIMIT=40m and
+ * MICROALLOC_HARD_LIMIT=72m.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../microalloc.h"
+
+#define COUNT            400000
+
+static void *objects[COUNT];
+
+int main(void)
+{
+    struct ma_stats st;
+    size_t i;
+    char *big;
+
+    for (i = 0; i < COUNT; i++) {
+        if ((objects[i] = malloc(100)) == NULL) {
+            fprintf(stderr, "limit_reclaim: malloc %zu failed\n", i);
+            return 1;
+        }
+        memset(objects[i], 1, 100);
+    }
+    for (i = 0; i < COUNT; i++)
+        free(objects[i]);
+    if ((big = malloc(30 << 20)) == NULL) {
+        ma_get_stats(&st);
+        fprintf(stderr, "limit_reclaim: 30m allocation failed with a "
+                "footprint of %zu\n", st.footprint);
+        return 1;
+    }
+    memset(big, 1, 30 << 20);
+    free(big);
+    return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * maintenance - with MICROALLOC_BG_INTERVAL_MS set, freed memory goes
+ * back to the system without any further calls: pages in the middle of
+ * the heap are purged and free space at its end is trimmed. make test
+ * runs it with a 10 ms interval.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "../microalloc.h"
+
+#define COUNT            20000
+#define SIZE             1000
+
+static void *objects[COUNT];
+
+// resident set size in bytes
+static size_t rss(void)
+{
+    char buf[128], *p;
+    ssize_t n;
+    int fd;
+
+    if ((fd = open("/proc/self/statm", O_RDONLY)) < 0)
+        return 0;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+    p = strchr(buf, ' ');
+    return p == NULL ? 0 : strtoull(p + 1, NULL, 10) * sysconf(_SC_PAGESIZE);
+}
+
+int main(void)
+{
+    struct ma_stats st;
+    size_t before, footprint;
+    void *last;
+    int i;
+
+    for (i = 0; i < COUNT; i++) {
+        objects[i] = malloc(SIZE);
+        memset(objects[i], 1, SIZE);
+    }
+    // pins the end of the heap, so only purging can give pages back
+    last = malloc(SIZE);
+    before = rss();
+    for (i = 0; i < COUNT; i++)
+        free(objects[i]);
+    usleep(300000);
+    if (rss() + COUNT * SIZE / 2 > before) {
+        fprintf(stderr, "maintenance: %zu kB resident before the free and "
+                "%zu kB after\n", before >> 10, rss() >> 10);
+        return 1;
+    }
+
+    ma_get_stats(&st);
+    footprint = st.footprint;
+    free(last);
+    usleep(300000);
+    ma_get_stats(&st);
+    if (st.footprint + COUNT * SIZE / 2 > footprint) {
+        fprintf(stderr, "maintenance: footprint went from %zu to %zu "
+                "bytes\n", footprint, st.footprint);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * malloc_near - an allocation next to a free block should be carved from
+ * the side of the block that touches its hint. run it with
+ * MICROALLOC_TCACHE=0 and MICROALLOC_QUICK=0, so frees reach the heap.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../microalloc.h"
+
+#define COUNT            40
+
+int main(void)
+{
+    char *below[COUNT], *hint, *near, *far;
+    int i;
+
+    for (i = 0; i < COUNT; i++)
+        below[i] = malloc(100);
+    hint = malloc(40);
+    // keeps the free space above the hint from joining the top of the heap
+    far = malloc(40);
+    for (i = 0; i < COUNT; i++)
+        free(below[i]);
+
+    // the free space below the hint is one block about 4k long
+    near = malloc_near(40, hint);
+    if (near == NULL || near > hint || hint - near > 64) {
+        fprintf(stderr, "malloc_near: got %p for a hint at %p, with free "
+                "space from %p\n", (void *) near, (void *) hint,
+                (void *) below[0]);
+        return 1;
+    }
+    free(near);
+    free(hint);
+    free(far);
+    return 0;
+}
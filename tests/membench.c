@@ -0,0 +1,50 @@
+/*
+ * membench - tools/membench should find microalloc's counters when it's
+ * preloaded, count at least the bytes its workload has live as
+ * allocated, and see the maintenance thread give some of the freed
+ * memory back. run it from the top of the tree after make membench.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(void)
+{
+    char line[256], phase[16];
+    unsigned long ops, rss, live, alloc, footprint, freed, returned;
+    int rows = 0, microalloc = 0, done = 0;
+    FILE *out;
+
+    out = popen("MICROALLOC_BG_INTERVAL_MS=10 LD_PRELOAD=./microalloc.so "
+                "tools/membench -n 100000 -s 4 -w 1000", "r");
+    if (out == NULL) {
+        perror("membench: tools/membench");
+        return 1;
+    }
+    while (fgets(line, sizeof(line), out) != NULL) {
+        if (strncmp(line, "allocator: microalloc", 21) == 0)
+            microalloc = 1;
+        if (sscanf(line, "%15s %lu %lu %lu %lu %lu", phase, &ops, &rss,
+                   &live, &alloc, &footprint) == 6) {
+            rows++;
+            if (alloc < live || rss < live) {
+                fprintf(stderr, "membench: %s", line);
+                pclose(out);
+                return 1;
+            }
+        }
+        if (sscanf(line, "freed %lu kB: %lu kB", &freed, &returned) == 2)
+            done = 1;
+    }
+    if (pclose(out) != 0 || !microalloc || rows == 0 || !done) {
+        fprintf(stderr, "membench: tools/membench didn't run on microalloc "
+                "to the end\n");
+        return 1;
+    }
+    if (returned == 0) {
+        fprintf(stderr, "membench: none of the %lu kB freed went back to "
+                "the system\n", freed);
+        return 1;
+    }
+    return 0;
+}
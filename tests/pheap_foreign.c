@@ -0,0 +1,62 @@
+/*
+ * pheap_foreign - free and realloc must refuse pointers into a
+ * persistent heap rather than caching them for the process heap. make
+ * test runs it with and without the thread caches.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "../microalloc.h"
+
+#define COUNT            64
+
+int main(void)
+{
+    char path[] = "/tmp/pheap_foreignXXXXXX";
+    void *objects[COUNT], *p;
+    ma_pheap *ph;
+    int fd, saved, i, j, bad = 0;
+
+    if ((fd = mkstemp(path)) < 0) {
+        perror("pheap_foreign: mkstemp");
+        return 1;
+    }
+    close(fd);
+    unlink(path);
+    if ((ph = ma_pheap_open(path, 1 << 20)) == NULL) {
+        perror("pheap_foreign: ma_pheap_open");
+        return 1;
+    }
+    for (i = 0; i < COUNT; i++)
+        objects[i] = ma_pmalloc(ph, 48);
+
+    // both calls complain on stderr, which isn't worth showing
+    saved = dup(2);
+    dup2(open("/dev/null", O_WRONLY), 2);
+    for (i = 0; i < COUNT; i++)
+        free(objects[i]);
+    p = realloc(objects[0], 4000);
+    dup2(saved, 2);
+    if (p != NULL) {
+        fprintf(stderr, "pheap_foreign: realloc moved a persistent heap "
+                "block\n");
+        return 1;
+    }
+
+    // none of the freed blocks may come back from malloc
+    for (i = 0; i < 4 * COUNT; i++) {
+        p = malloc(48);
+        for (j = 0; j < COUNT; j++)
+            bad |= p == objects[j];
+    }
+    ma_pheap_close(ph);
+    unlink(path);
+    if (bad) {
+        fprintf(stderr, "pheap_foreign: malloc returned a persistent heap "
+                "block\n");
+        return 1;
+    }
+    return 0;
+}
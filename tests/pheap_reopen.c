@@ -0,0 +1,85 @@
+/*
+ * pheap_reopen - a persistent heap filled to its capacity keeps its data
+ * across a close and reopen, and its free space is reused afterwards.
+ * make test also runs it with MICROALLOC_THP=1, whose 2 MB growth steps
+ * mustn't apply to a heap whose size is its file's.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../microalloc.h"
+
+#define CAPACITY         (1 << 20)
+#define SIZE             400
+
+typedef struct node {
+    size_t next;
+    long value;
+    char data[SIZE - 16];
+} Node;
+
+int main(void)
+{
+    char path[] = "/tmp/pheap_reopenXXXXXX";
+    size_t head = 0, off;
+    ma_pheap *ph;
+    Node *n;
+    long count = 0, seen = 0;
+    int fd;
+
+    if ((fd = mkstemp(path)) < 0) {
+        perror("pheap_reopen: mkstemp");
+        return 1;
+    }
+    close(fd);
+    unlink(path);
+    if ((ph = ma_pheap_open(path, CAPACITY)) == NULL) {
+        perror("pheap_reopen: ma_pheap_open");
+        return 1;
+    }
+    // a list of nodes, linked by offset, filling the heap
+    while ((n = ma_pmalloc(ph, sizeof(Node))) != NULL) {
+        n->value = count++;
+        memset(n->data, n->value, sizeof(n->data));
+        n->next = head;
+        head = ma_pheap_offset(ph, n);
+    }
+    if (count < CAPACITY / SIZE * 3 / 4) {
+        fprintf(stderr, "pheap_reopen: only %ld nodes fit\n", count);
+        return 1;
+    }
+    ma_pheap_set_root(ph, ma_pheap_ptr(ph, head));
+    ma_pheap_close(ph);
+
+    if ((ph = ma_pheap_open(path, CAPACITY)) == NULL) {
+        perror("pheap_reopen: reopening");
+        return 1;
+    }
+    for (off = ma_pheap_offset(ph, ma_pheap_root(ph)); off != 0; ) {
+        n = ma_pheap_ptr(ph, off);
+        off = n->next;
+        if (n->value != count - 1 - seen ||
+            n->data[sizeof(n->data) - 1] != (char) n->value) {
+            fprintf(stderr, "pheap_reopen: node %ld is wrong\n", seen);
+            return 1;
+        }
+        seen++;
+        // free every other node, so there's space to reuse below
+        if (seen % 2 == 0)
+            ma_pfree(ph, n);
+    }
+    if (seen != count) {
+        fprintf(stderr, "pheap_reopen: %ld of %ld nodes came back\n", seen,
+                count);
+        return 1;
+    }
+    if (ma_pmalloc(ph, sizeof(Node)) == NULL) {
+        fprintf(stderr, "pheap_reopen: freed space wasn't reused\n");
+        return 1;
+    }
+    ma_pheap_close(ph);
+    unlink(path);
+    return 0;
+}
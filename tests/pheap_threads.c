@@ -0,0 +1,82 @@
+/*
+ * pheap_threads - persistent heaps used while other threads churn the
+ * process heap. growing a persistent heap must never touch the process
+ * heap's lists, which ma_pmalloc doesn't hold heap_lock for. run it with
+ * MICROALLOC_TCACHE=0 so small frees go through the quick lists.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "../microalloc.h"
+
+#define THREADS          4
+#define ROUNDS           200
+#define PALLOCS          1024
+#define LIVE             512
+
+static atomic_bool done;
+
+// free and reallocate random small objects until the main thread is done
+static void *churn(void *arg)
+{
+    void *live[LIVE] = {0};
+    unsigned seed = (unsigned) (uintptr_t) arg;
+    size_t i;
+
+    while (!atomic_load(&done)) {
+        i = rand_r(&seed) % LIVE;
+        free(live[i]);
+        if ((live[i] = malloc(16 + rand_r(&seed) % 400)) == NULL) {
+            fprintf(stderr, "pheap_threads: malloc failed\n");
+            exit(1);
+        }
+        memset(live[i], 1, 16);
+    }
+    for (i = 0; i < LIVE; i++)
+        free(live[i]);
+    return NULL;
+}
+
+int main(void)
+{
+    pthread_t threads[THREADS];
+    char path[] = "/tmp/pheap_threadsXXXXXX";
+    ma_pheap *ph;
+    void *p[PALLOCS];
+    int fd, r, i, j;
+
+    if ((fd = mkstemp(path)) < 0) {
+        perror("pheap_threads: mkstemp");
+        return 1;
+    }
+    close(fd);
+    for (i = 0; i < THREADS; i++)
+        pthread_create(&threads[i], NULL, churn, (void *) (uintptr_t) i + 1);
+    for (r = 0; r < ROUNDS; r++) {
+        unlink(path);
+        if ((ph = ma_pheap_open(path, 4 << 20)) == NULL) {
+            perror("pheap_threads: ma_pheap_open");
+            return 1;
+        }
+        for (j = 0; j < PALLOCS; j++) {
+            if ((p[j] = ma_pmalloc(ph, 100 + j % 64 * 8)) == NULL) {
+                fprintf(stderr, "pheap_threads: ma_pmalloc failed\n");
+                return 1;
+            }
+            memset(p[j], 2, 100);
+        }
+        for (j = 0; j < PALLOCS; j += 2)
+            ma_pfree(ph, p[j]);
+        ma_pheap_close(ph);
+    }
+    atomic_store(&done, true);
+    for (i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * pheap_unsorted - a large allocation from a full persistent heap should
+ * find the big free block behind many small ones on the heap's unsorted
+ * list. make test runs it with the maintenance thread on, which caps how
+ * much of a process heap's unsorted list an allocation sorts.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../microalloc.h"
+
+#define CAPACITY         (1 << 20)
+#define SIZE             200
+#define MAXOBJS          (CAPACITY / SIZE)
+// the run freed first, which coalesces into one big block
+#define RUN              20
+// small holes freed after it, so they're ahead of it on the list
+#define HOLES            200
+
+int main(void)
+{
+    static void *objs[MAXOBJS];
+    char path[] = "/tmp/pheap_unsortedXXXXXX";
+    ma_pheap *ph;
+    void *big;
+    int fd, i, count = 0;
+
+    if ((fd = mkstemp(path)) < 0) {
+        perror("pheap_unsorted: mkstemp");
+        return 1;
+    }
+    close(fd);
+    unlink(path);
+    if ((ph = ma_pheap_open(path, CAPACITY)) == NULL) {
+        perror("pheap_unsorted: ma_pheap_open");
+        return 1;
+    }
+    while (count < MAXOBJS && (objs[count] = ma_pmalloc(ph, SIZE)) != NULL)
+        count++;
+    if (count < RUN + 2 * HOLES + 2) {
+        fprintf(stderr, "pheap_unsorted: only %d objects fit\n", count);
+        return 1;
+    }
+
+    for (i = 1; i <= RUN; i++)
+        ma_pfree(ph, objs[i]);
+    // every other object, so the holes can't coalesce
+    for (i = RUN + 2; i < RUN + 2 + 2 * HOLES; i += 2)
+        ma_pfree(ph, objs[i]);
+
+    if ((big = ma_pmalloc(ph, SIZE * RUN / 2)) == NULL) {
+        fprintf(stderr, "pheap_unsorted: no room for %d bytes with %d "
+                "freed in one run\n", SIZE * RUN / 2, SIZE * RUN);
+        return 1;
+    }
+    ma_pheap_close(ph);
+    return 0;
+}
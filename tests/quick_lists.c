@@ -0,0 +1,77 @@
+/*
+ * quick_lists - small blocks freed onto the lock-free quick lists should
+ * never be handed to two threads at once, and should go back into the
+ * heap before it grows. run it with MICROALLOC_TCACHE=0, so every small
+ * free and malloc goes through the quick lists.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "../microalloc.h"
+
+#define THREADS          8
+#define ROUNDS           200000
+#define BATCH            16
+// blocks freed together, whose total stays below MICROALLOC_LARGE
+#define COUNT            80
+#define SIZE             48
+
+static void *fill(void *arg)
+{
+    long id = (long) arg, *p[BATCH];
+    int i, j;
+
+    for (i = 0; i < ROUNDS / BATCH; i++) {
+        for (j = 0; j < BATCH; j++) {
+            p[j] = malloc(SIZE + j % 3 * 16);
+            p[j][0] = id;
+            p[j][1] = i;
+        }
+        sched_yield();
+        for (j = 0; j < BATCH; j++) {
+            if (p[j][0] != id || p[j][1] != i) {
+                fprintf(stderr, "quick_lists: a block was handed to thread "
+                        "%ld while thread %ld had it\n", p[j][0], id);
+                exit(1);
+            }
+            free(p[j]);
+        }
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    static void *objects[COUNT];
+    pthread_t threads[THREADS];
+    struct ma_stats before, after;
+    void *pin;
+    long i;
+
+    /* a request as pin as all of these together fits once the quick
+     * lists give them back to be coalesced */
+    for (i = 0; i < COUNT; i++)
+        objects[i] = malloc(SIZE);
+    // keeps the space from being the end of the heap, which could grow
+    pin = malloc(SIZE);
+    for (i = 0; i < COUNT; i++)
+        free(objects[i]);
+    ma_get_stats(&before);
+    free(malloc(COUNT * SIZE));
+    ma_get_stats(&after);
+    if (after.grow_calls != before.grow_calls) {
+        fprintf(stderr, "quick_lists: the heap grew while %d freed blocks "
+                "could have made room\n", COUNT);
+        return 1;
+    }
+    free(pin);
+
+    for (i = 0; i < THREADS; i++)
+        pthread_create(&threads[i], NULL, fill, (void *) i);
+    for (i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+    return 0;
+}
@@ -0,0 +1,70 @@
+/*
+ * reserve - with MICROALLOC_RESERVE, allocations that fit in the
+ * reservation should neither grow the heap nor fault pages in, large ones
+ * included, and ones beyond it should be counted. make test runs it with
+ * a 16 MB reservation.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "../microalloc.h"
+
+#define RESERVE          (16 << 20)
+#define COUNT            400
+// sizes of the small and large allocations, about 4 MB in all
+#define SMALL            1000
+#define LARGE            (20 << 10)
+
+static void *objects[COUNT];
+
+static long faults(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_minflt;
+}
+
+int main(void)
+{
+    struct ma_stats before, after;
+    long faulted;
+    void *extra;
+    int i;
+
+    ma_get_stats(&before);
+    if (before.reserved < RESERVE) {
+        fprintf(stderr, "reserve: only %zu bytes reserved\n",
+                before.reserved);
+        return 1;
+    }
+    faulted = faults();
+    for (i = 0; i < COUNT; i++) {
+        objects[i] = malloc(i % 2 == 0 ? SMALL : LARGE);
+        memset(objects[i], 1, i % 2 == 0 ? SMALL : LARGE);
+    }
+    faulted = faults() - faulted;
+    ma_get_stats(&after);
+    if (after.grow_calls != before.grow_calls ||
+        after.outside_reserve != 0 || faulted > 20) {
+        fprintf(stderr, "reserve: %zu grow calls, %zu allocations outside "
+                "the reservation and %ld page faults\n",
+                after.grow_calls - before.grow_calls, after.outside_reserve,
+                faulted);
+        return 1;
+    }
+
+    extra = malloc(RESERVE);
+    ma_get_stats(&after);
+    if (after.outside_reserve == 0) {
+        fprintf(stderr, "reserve: an allocation bigger than the "
+                "reservation wasn't counted\n");
+        return 1;
+    }
+    free(extra);
+    for (i = 0; i < COUNT; i++)
+        free(objects[i]);
+    return 0;
+}
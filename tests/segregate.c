@@ -0,0 +1,51 @@
+/*
+ * segregate - with MICROALLOC_SEGREGATE=1, a call site whose objects
+ * outlive MICROALLOC_LONG_LIVED calls to malloc should be moved off the
+ * main heap at the program break, while a site whose objects die young
+ * stays on it. make test runs it with a lifetime of 1000 calls.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../microalloc.h"
+
+// long lived objects, each freed after about RING * 3 calls to malloc
+#define RING             2000
+#define ROUNDS           100000
+#define SIZE             48
+
+static void *ring[RING];
+
+int main(void)
+{
+    void *young;
+    int i, j;
+
+    for (i = 0; i < ROUNDS; i++) {
+        free(ring[i % RING]);
+        ring[i % RING] = malloc(SIZE);
+        for (j = 0; j < 2; j++) {
+            young = malloc(SIZE);
+            free(young);
+        }
+    }
+    young = malloc(SIZE);
+    if ((char *) young > (char *) sbrk(0)) {
+        fprintf(stderr, "segregate: a short lived site left the main "
+                "heap\n");
+        return 1;
+    }
+    for (i = 0, j = 0; i < RING; i++)
+        if ((char *) ring[i] > (char *) sbrk(0))
+            j++;
+    if (j < RING / 2) {
+        fprintf(stderr, "segregate: only %d of %d long lived objects left "
+                "the main heap\n", j, RING);
+        return 1;
+    }
+    free(young);
+    for (i = 0; i < RING; i++)
+        free(ring[i]);
+    return 0;
+}
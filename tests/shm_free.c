@@ -0,0 +1,109 @@
+/*
+ * shm_free - a child process that maps a shared heap at its own address
+ * should be able to read and free what the parent allocated in it, while
+ * both allocate from it at once, and the parent should then be able to
+ * reuse every freed byte.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "../microalloc.h"
+
+#define CAPACITY         (1 << 20)
+#define SIZE             200
+#define CHURN            20000
+
+typedef struct node {
+    size_t next;
+    long value;
+    char data[SIZE - 16];
+} Node;
+
+// allocate and free in ph, checking that nothing handed out is corrupted
+static int churn(ma_pheap *ph, int fill)
+{
+    Node *n;
+    int i;
+
+    for (i = 0; i < CHURN; i++) {
+        if ((n = ma_pmalloc(ph, sizeof(Node))) == NULL)
+            continue;
+        memset(n->data, fill, sizeof(n->data));
+        if (n->data[0] != fill || n->data[sizeof(n->data) - 1] != fill)
+            return -1;
+        ma_pfree(ph, n);
+    }
+    return 0;
+}
+
+int main(void)
+{
+    ma_pheap *ph;
+    size_t head = 0, off;
+    long count = 0, seen, refill = 0;
+    Node *n;
+    int fd, status;
+    pid_t pid;
+
+    if ((fd = memfd_create("shm_free", 0)) < 0 ||
+        (ph = ma_shm_attach(fd, CAPACITY)) == NULL) {
+        perror("shm_free: creating the heap");
+        return 1;
+    }
+    // fill the heap with a list, leaving room for the churn
+    while (count < CAPACITY / SIZE * 3 / 4 &&
+           (n = ma_pmalloc(ph, sizeof(Node))) != NULL) {
+        n->value = count++;
+        memset(n->data, n->value, sizeof(n->data));
+        n->next = head;
+        head = ma_pheap_offset(ph, n);
+    }
+    ma_pheap_set_root(ph, ma_pheap_ptr(ph, head));
+
+    if ((pid = fork()) == 0) {
+        // a mapping of its own, likely at another address
+        if ((ph = ma_shm_attach(fd, CAPACITY)) == NULL)
+            _exit(2);
+        seen = 0;
+        for (off = ma_pheap_offset(ph, ma_pheap_root(ph)); off != 0; ) {
+            n = ma_pheap_ptr(ph, off);
+            if (n->value != count - 1 - seen ||
+                n->data[0] != (char) n->value)
+                _exit(3);
+            off = n->next;
+            ma_pfree(ph, n);
+            seen++;
+        }
+        ma_pheap_set_root(ph, NULL);
+        _exit(seen == count && churn(ph, 'c') == 0 ? 0 : 4);
+    }
+    if (churn(ph, 'p') < 0) {
+        fprintf(stderr, "shm_free: an allocation was corrupted\n");
+        return 1;
+    }
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "shm_free: the child failed with status %#x\n",
+                status);
+        return 1;
+    }
+    if (ma_pheap_root(ph) != NULL) {
+        fprintf(stderr, "shm_free: the child's root wasn't seen\n");
+        return 1;
+    }
+    while (ma_pmalloc(ph, sizeof(Node)) != NULL)
+        refill++;
+    if (refill < count) {
+        fprintf(stderr, "shm_free: only %ld of the %ld nodes the child "
+                "freed could be allocated again\n", refill, count);
+        return 1;
+    }
+    ma_pheap_close(ph);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * should_move - on a heap of equally sparse pages, ma_should_move should
+ * pack the survivors onto fewer pages, and leave objects on full pages
+ * alone. run it with MICROALLOC_TCACHE=0 and MICROALLOC_QUICK=0, so frees
+ * reach the heap.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../microalloc.h"
+
+#define COUNT            3000
+#define SIZE             600
+// keep one object in every KEEP, about one per page
+#define KEEP             7
+#define PAGE             4096
+
+// number of distinct pages the kept objects start on
+static int pages_used(char **objs)
+{
+    static uintptr_t seen[COUNT / KEEP + 1];
+    int i, j, n = 0;
+
+    for (i = 0; i < COUNT; i += KEEP) {
+        for (j = 0; j < n; j++)
+            if (seen[j] == (uintptr_t) objs[i] / PAGE)
+                break;
+        if (j == n)
+            seen[n++] = (uintptr_t) objs[i] / PAGE;
+    }
+    return n;
+}
+
+int main(void)
+{
+    static char *objs[COUNT];
+    char *dense[8], *top, *new;
+    int i, before, after, moves = 0;
+
+    for (i = 0; i < 8; i++)
+        dense[i] = malloc(SIZE);
+    if (ma_should_move(dense[3]) != NULL) {
+        fprintf(stderr, "should_move: moved an object off a full page\n");
+        return 1;
+    }
+
+    for (i = 0; i < COUNT; i++) {
+        objs[i] = malloc(SIZE);
+        memset(objs[i], i & 0xff, SIZE);
+    }
+    // keeps the freed space from joining the top of the heap
+    top = malloc(SIZE);
+    for (i = 0; i < COUNT; i++)
+        if (i % KEEP != 0)
+            free(objs[i]);
+    before = pages_used(objs);
+
+    for (i = 0; i < COUNT; i += KEEP) {
+        if ((new = ma_should_move(objs[i])) == NULL)
+            continue;
+        memcpy(new, objs[i], SIZE);
+        free(objs[i]);
+        objs[i] = new;
+        moves++;
+    }
+    after = pages_used(objs);
+    for (i = 0; i < COUNT; i += KEEP) {
+        if (objs[i][0] != (char) (i & 0xff) ||
+            objs[i][SIZE - 1] != (char) (i & 0xff)) {
+            fprintf(stderr, "should_move: object %d lost its contents\n", i);
+            return 1;
+        }
+    }
+    if (after * 2 > before) {
+        fprintf(stderr, "should_move: %d moves took the objects from %d "
+                "pages to %d\n", moves, before, after);
+        return 1;
+    }
+
+    for (i = 0; i < COUNT; i += KEEP)
+        free(objs[i]);
+    for (i = 0; i < 8; i++)
+        free(dense[i]);
+    free(top);
+    return 0;
+}
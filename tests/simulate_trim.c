@@ -0,0 +1,57 @@
+/*
+ * simulate_trim - tools/simulate's TRIM setting has to change what it
+ * measures. a trace that frees everything it allocated is replayed with a
+ * low and a high trim threshold, and the low one has to end with the
+ * smaller footprint. run it from the top of the tree after make simulate.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define COUNT            20000
+
+int main(void)
+{
+    char path[] = "/tmp/simulate_trimXXXXXX", cmd[128], line[256], *end;
+    unsigned long long footprint[2];
+    FILE *trace, *out;
+    int fd, i, rows = 0;
+
+    if ((fd = mkstemp(path)) < 0 || (trace = fdopen(fd, "w")) == NULL) {
+        perror("simulate_trim: trace");
+        return 1;
+    }
+    for (i = 1; i <= COUNT; i++)
+        fprintf(trace, "m %x %d\n", i, 100 + i % 16 * 8);
+    for (i = 1; i <= COUNT; i++)
+        fprintf(trace, "m %x 3000\n", COUNT + i);
+    for (i = 1; i <= 2 * COUNT; i++)
+        fprintf(trace, "f %x\n", i);
+    fclose(trace);
+
+    snprintf(cmd, sizeof(cmd), "tools/simulate %s TRIM=64k,64m", path);
+    if ((out = popen(cmd, "r")) == NULL) {
+        perror("simulate_trim: tools/simulate");
+        unlink(path);
+        return 1;
+    }
+    // skip the header, then take the last column of each row
+    while (fgets(line, sizeof(line), out) != NULL) {
+        if (strncmp(line, "TRIM,", 5) == 0 || rows == 2)
+            continue;
+        if ((end = strrchr(line, ',')) != NULL)
+            footprint[rows++] = strtoull(end + 1, NULL, 10);
+    }
+    unlink(path);
+    if (pclose(out) != 0 || rows != 2) {
+        fprintf(stderr, "simulate_trim: tools/simulate failed\n");
+        return 1;
+    }
+    if (footprint[0] >= footprint[1]) {
+        fprintf(stderr, "simulate_trim: TRIM=64k ended with %llu bytes and "
+                "TRIM=64m with %llu\n", footprint[0], footprint[1]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * tags - allocations of every kind made under a tag should be counted
+ * under it, keep the tag through realloc whatever tag the reallocating
+ * thread has, and stop counting when another thread frees them. make test
+ * also runs it with MICROALLOC_COW=1, for small blocks in the slab.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "../microalloc.h"
+
+#define TAG              9
+#define KINDS            6
+
+// request sizes for the slab or heap, heap, buddy and large mappings
+static const size_t sizes[KINDS] = {40, 2000, 64 << 10, 3 << 20, 300, 5000};
+static void *objects[KINDS];
+
+static size_t live(void)
+{
+    static struct ma_stats st;
+
+    ma_get_stats(&st);
+    return st.tag_bytes[TAG];
+}
+
+static void *free_all(void *arg)
+{
+    int i;
+
+    for (i = 0; i < KINDS; i++)
+        free(objects[i]);
+    return arg;
+}
+
+int main(void)
+{
+    pthread_t thread;
+    size_t total = 0, counted;
+    int i;
+
+    if (ma_set_tag(TAG) != 0 || ma_set_tag(TAG) != TAG) {
+        fprintf(stderr, "tags: ma_set_tag didn't return the old tag\n");
+        return 1;
+    }
+    for (i = 0; i < KINDS - 2; i++)
+        objects[i] = malloc(sizes[i]);
+    objects[4] = calloc(1, sizes[4]);
+    posix_memalign(&objects[5], 4096, sizes[5]);
+    for (i = 0; i < KINDS; i++)
+        total += sizes[i];
+    ma_set_tag(0);
+    free(malloc(1000));
+    if ((counted = live()) < total) {
+        fprintf(stderr, "tags: %zu of %zu tagged bytes counted\n", counted,
+                total);
+        return 1;
+    }
+
+    // realloc by an untagged thread, within and across kinds
+    objects[0] = realloc(objects[0], sizes[0] * 2);
+    objects[1] = realloc(objects[1], sizes[2]);
+    if (live() < total + sizes[0] + sizes[2] - sizes[1]) {
+        fprintf(stderr, "tags: realloc lost a block's tag\n");
+        return 1;
+    }
+
+    pthread_create(&thread, NULL, free_all, NULL);
+    pthread_join(thread, NULL);
+    if (live() != 0) {
+        fprintf(stderr, "tags: %zu bytes still counted after another thread "
+                "freed everything\n", live());
+        return 1;
+    }
+    return 0;
+}
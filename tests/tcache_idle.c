@@ -0,0 +1,105 @@
+/*
+ * tcache_idle - with MICROALLOC_BG_INTERVAL_MS set, small blocks cached
+ * by a thread that has stopped allocating should go back to the heap
+ * within a few intervals, while a busy thread keeps its cache. make test
+ * runs it with a 10 ms interval.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "../microalloc.h"
+
+#define COUNT            200
+// request sizes of the idle and the busy thread, and their block sizes
+#define IDLE             100
+#define BUSY             300
+#define IDLEBLOCK(s)     ((s) > IDLE && (s) < IDLE + 64)
+#define BUSYBLOCK(s)     ((s) > BUSY && (s) < BUSY + 64)
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int ready, stop;
+
+static void *idle(void *arg)
+{
+    static void *objects[COUNT];
+    int i;
+
+    for (i = 0; i < COUNT; i++)
+        objects[i] = malloc(IDLE);
+    for (i = 0; i < COUNT; i++)
+        free(objects[i]);
+    pthread_mutex_lock(&lock);
+    ready++;
+    pthread_cond_broadcast(&cond);
+    while (!stop)
+        pthread_cond_wait(&cond, &lock);
+    pthread_mutex_unlock(&lock);
+    return arg;
+}
+
+static void *busy(void *arg)
+{
+    static void *objects[COUNT];
+    int i;
+
+    for (i = 0; i < COUNT; i++)
+        objects[i] = malloc(BUSY);
+    for (i = 0; i < COUNT; i++)
+        free(objects[i]);
+    pthread_mutex_lock(&lock);
+    ready++;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    // one block at a time, so the rest stay cached
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+        free(malloc(BUSY));
+    return arg;
+}
+
+static void count(const struct ma_block *b, void *arg)
+{
+    int *counts = arg;
+
+    if (b->kind != MA_KIND_HEAP || b->state != MA_QUICK)
+        return;
+    if (IDLEBLOCK(b->size))
+        counts[0]++;
+    else if (BUSYBLOCK(b->size))
+        counts[1]++;
+}
+
+int main(void)
+{
+    pthread_t threads[2];
+    int counts[2] = {0, 0};
+
+    pthread_create(&threads[0], NULL, idle, NULL);
+    pthread_create(&threads[1], NULL, busy, NULL);
+    pthread_mutex_lock(&lock);
+    while (ready < 2)
+        pthread_cond_wait(&cond, &lock);
+    pthread_mutex_unlock(&lock);
+
+    usleep(200000);
+    ma_heap_visit(count, counts);
+    pthread_mutex_lock(&lock);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+
+    if (counts[0] != 0) {
+        fprintf(stderr, "tcache_idle: an idle thread still caches %d "
+                "blocks\n", counts[0]);
+        return 1;
+    }
+    if (counts[1] == 0) {
+        fprintf(stderr, "tcache_idle: a busy thread's cache was emptied\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,68 @@
+/*
+ * thp_heap - with MICROALLOC_THP=1, the heap should end on a 2 MB
+ * boundary, grow 2 MB at a time rather than by each request, and be
+ * advised for huge pages.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "../microalloc.h"
+
+#define HUGEPAGE         ((uintptr_t) 2 << 20)
+#define COUNT            5000
+#define SIZE             1000
+
+static void *objects[COUNT];
+
+// whether the mapping holding p is advised for huge pages
+static int advised(void *p)
+{
+    char line[256];
+    unsigned long start, end;
+    int in = 0, hg = 0;
+    FILE *smaps;
+
+    if ((smaps = fopen("/proc/self/smaps", "r")) == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), smaps) != NULL) {
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+            in = (uintptr_t) p >= start && (uintptr_t) p < end;
+        else if (in && strncmp(line, "VmFlags:", 8) == 0)
+            hg = strstr(line, " hg") != NULL;
+    }
+    fclose(smaps);
+    return hg;
+}
+
+int main(void)
+{
+    struct ma_stats before, after;
+    int i;
+
+    objects[0] = malloc(SIZE);
+    ma_get_stats(&before);
+    for (i = 1; i < COUNT; i++)
+        objects[i] = malloc(SIZE);
+    ma_get_stats(&after);
+
+    if ((uintptr_t) sbrk(0) % HUGEPAGE != 0) {
+        fprintf(stderr, "thp_heap: the break %p isn't on a huge page\n",
+                sbrk(0));
+        return 1;
+    }
+    if (after.grow_calls - before.grow_calls > COUNT * SIZE / HUGEPAGE + 1) {
+        fprintf(stderr, "thp_heap: %zu calls to grow the heap by %d bytes\n",
+                after.grow_calls - before.grow_calls, COUNT * SIZE);
+        return 1;
+    }
+    if (!advised(objects[COUNT - 1])) {
+        fprintf(stderr, "thp_heap: the heap isn't advised for huge pages\n");
+        return 1;
+    }
+    for (i = 0; i < COUNT; i++)
+        free(objects[i]);
+    return 0;
+}
@@ -0,0 +1,264 @@
+/*
+ * classgen - choose the free lists' size classes for a workload and write
+ * them as size_classes.h. when that file exists, make builds microalloc.so
+ * with -DMA_CLASS_TABLE and find_list_index looks sizes up in its table.
+ *
+ * usage: classgen [-l limit] [-s spread] [-o file] [input]
+ *
+ * the input is either a heap dump written by ma_heap_dump, whose allocated
+ * heap blocks are counted, or text with one request size per line,
+ * optionally followed by how many times it was requested - an allocation
+ * trace or a histogram. lines starting with '#' are skipped. standard
+ * input is read if no file is given.
+ *
+ * block sizes under limit (default 4096) get lists chosen here, and larger
+ * ones keep a list per power of two. searching a list skips the blocks on
+ * it that are too small, so the classes are picked to skip as few as
+ * possible for the sizes in the input: popular sizes get lists of their
+ * own and the rest share. no list spans sizes more than spread percent
+ * (default 12.5) apart, which bounds how much bigger than a request the
+ * first block that fits can be.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <float.h>
+#include <unistd.h>
+
+#include "../microalloc.h"
+
+// these mirror mm.c
+#define LISTCOUNT        75
+#define MINBLOCK         32
+#define BLOCKSIZE(u)     (((u) + 16 + 15) & ~(uint64_t) 7)
+// sizes from here up share the last list
+#define LASTSHIFT        20
+
+#define MINSHIFT         9
+#define MAXSHIFT         16
+
+// count the allocated heap blocks in a dump, by block size / 8
+static int read_dump(FILE *in, double *weight, size_t slots)
+{
+    struct ma_dump_header hdr;
+    struct ma_dump_record rec;
+    uint64_t i;
+
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 || hdr.magic != MA_DUMP_MAGIC)
+        return -1;
+    for (i = 0; i < hdr.count; i++) {
+        if (fread(&rec, sizeof(rec), 1, in) != 1)
+            return -1;
+        if (rec.kind == MA_KIND_HEAP && rec.state == MA_ALLOCATED &&
+            rec.size / 8 < slots)
+            weight[rec.size / 8]++;
+    }
+    return 0;
+}
+
+// count request sizes from a trace or histogram, by block size / 8
+static int read_text(FILE *in, double *weight, size_t slots)
+{
+    char line[256], *end;
+    uint64_t size, block;
+    double count;
+    long n = 0;
+
+    while (fgets(line, sizeof(line), in) != NULL) {
+        n++;
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+        size = strtoull(line, &end, 0);
+        count = 1;
+        if (end == line || (*end != '\0' && strchr(" \t\r\n", *end) == NULL))
+            goto bad;
+        if (end[strspn(end, " \t\r\n")] != '\0') {
+            count = strtod(end, &end);
+            if (end[strspn(end, " \t\r\n")] != '\0' || count < 0)
+                goto bad;
+        }
+        if (size == 0)
+            continue;
+        block = BLOCKSIZE(size) < MINBLOCK ? MINBLOCK : BLOCKSIZE(size);
+        if (block / 8 < slots)
+            weight[block / 8] += count;
+    }
+    return 0;
+bad:
+    fprintf(stderr, "classgen: line %ld: expected a size and a count\n", n);
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    const char *out_path = NULL;
+    uint64_t limit = 4096, id = 0xcbf29ce484222325ull;
+    double spread = 12.5, total, missed, cost, *weight, *cum, *cross;
+    double *best, w;
+    int *from, shift, lists, k, opt, magic;
+    size_t slots, a, b, i, *cut;
+    unsigned char *table;
+    FILE *in = stdin, *out = stdout;
+
+    while ((opt = getopt(argc, argv, "l:s:o:")) != -1) {
+        switch (opt) {
+        case 'l': limit = strtoull(optarg, NULL, 0); break;
+        case 's': spread = strtod(optarg, NULL); break;
+        case 'o': out_path = optarg; break;
+        default:
+            fprintf(stderr, "usage: classgen [-l limit] [-s spread] "
+                    "[-o file] [input]\n");
+            return 1;
+        }
+    }
+    shift = limit == 0 ? 0 : __builtin_ctzll(limit);
+    if (limit != (uint64_t) 1 << shift || shift < MINSHIFT ||
+        shift > MAXSHIFT || spread < 0) {
+        fprintf(stderr, "classgen: limit must be a power of two from %d to "
+                "%d, and spread at least 0\n", 1 << MINSHIFT, 1 << MAXSHIFT);
+        return 1;
+    }
+    if (optind < argc && (in = fopen(argv[optind], "rb")) == NULL) {
+        fprintf(stderr, "classgen: %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    /* list 0 is the unsorted list, and the power of two lists from limit
+     * up to the shared last one come after the chosen ones */
+    lists = LISTCOUNT - 1 - (LASTSHIFT - shift + 1);
+    slots = limit / 8;
+    weight = calloc(slots, sizeof(double));
+    cum = calloc(slots + 1, sizeof(double));
+    cross = calloc(slots + 1, sizeof(double));
+    best = malloc((lists + 1) * (slots + 1) * sizeof(double));
+    from = malloc((lists + 1) * (slots + 1) * sizeof(int));
+    cut = calloc(lists + 1, sizeof(size_t));
+    table = malloc(slots + 1);
+    if (weight == NULL || cum == NULL || cross == NULL || best == NULL ||
+        from == NULL || cut == NULL || table == NULL) {
+        fprintf(stderr, "classgen: out of memory\n");
+        return 1;
+    }
+
+    magic = getc(in);
+    if (magic != EOF)
+        ungetc(magic, in);
+    if ((magic == (MA_DUMP_MAGIC & 0xff) ? read_dump(in, weight, slots) :
+                                           read_text(in, weight, slots)) < 0) {
+        fprintf(stderr, "classgen: couldn't read the input\n");
+        return 1;
+    }
+
+    /* cum[i] is the weight of the slots below i, and cross[i] sums each
+     * of their weights times the weight below it. if a list holds the
+     * same mix of sizes it's asked for, a search of it meets a block too
+     * small for it as often as the list's weight below the request over
+     * its whole weight. summed over its requests, a list of slots a to
+     * b - 1 with weight w gets (cross[b] - cross[a] - cum[a] * w) / w */
+    for (i = 0; i < slots; i++) {
+        cum[i + 1] = cum[i] + weight[i];
+        cross[i + 1] = cross[i] + weight[i] * cum[i];
+    }
+    total = cum[slots];
+    if (total == 0) {
+        fprintf(stderr, "classgen: no sizes under %llu in the input\n",
+                (unsigned long long) limit);
+        return 1;
+    }
+
+    /* best[k * (slots + 1) + b] is the lowest share of searches meeting
+     * a block that's too small, for slots up to b - 1 on k lists, and from[] is where the
+     * last of them starts. every list starts at MINBLOCK or above. */
+#define BEST(k, b) best[(size_t) (k) * (slots + 1) + (b)]
+#define FROM(k, b) from[(size_t) (k) * (slots + 1) + (b)]
+    for (k = 0; k <= lists; k++)
+        for (b = 0; b <= slots; b++)
+            BEST(k, b) = DBL_MAX;
+    BEST(0, MINBLOCK / 8) = 0;
+    for (k = 1; k <= lists; k++) {
+        for (b = MINBLOCK / 8 + 1; b <= slots; b++) {
+            // narrowest first, stopping once the spread is exceeded
+            for (a = b; a-- > MINBLOCK / 8;) {
+                if ((b - 1) * 100 > a * (100 + spread))
+                    break;
+                if (BEST(k - 1, a) == DBL_MAX)
+                    continue;
+                w = cum[b] - cum[a];
+                cost = BEST(k - 1, a) + (w == 0 ? 0 :
+                       (cross[b] - cross[a] - cum[a] * w) / w / total);
+                if (cost < BEST(k, b)) {
+                    BEST(k, b) = cost;
+                    FROM(k, b) = a;
+                }
+            }
+        }
+    }
+    // more lists never make it worse, so use as many as fit
+    for (k = lists; k > 0 && BEST(k, slots) == DBL_MAX; k--)
+        ;
+    if (k == 0) {
+        fprintf(stderr, "classgen: %d lists can't keep a %g%% spread "
+                "below %llu; raise -s or lower -l\n", lists, spread,
+                (unsigned long long) limit);
+        return 1;
+    }
+    missed = BEST(k, slots);
+    for (b = slots, i = k; i > 0; i--) {
+        cut[i - 1] = FROM(i, b);
+        b = cut[i - 1];
+    }
+
+    // list 1 also takes the sizes below MINBLOCK, which never occur
+    for (i = 0, b = 1; i < slots; i++) {
+        if (b < (size_t) k && i >= cut[b])
+            b++;
+        table[i] = b;
+    }
+    table[slots] = k + 1;
+    for (i = 0; i <= slots; i++)
+        id = (id ^ table[i]) * 0x100000001b3ull;
+    id = (id ^ shift) * 0x100000001b3ull;
+
+    if (out_path != NULL && (out = fopen(out_path, "w")) == NULL) {
+        fprintf(stderr, "classgen: %s: %s\n", out_path, strerror(errno));
+        return 1;
+    }
+    fprintf(out, "/*\n * size_classes.h - free list classes generated by "
+            "tools/classgen from\n * %.0f allocations. don't edit it; "
+            "regenerate it or delete it to go back\n * to the default "
+            "lists.\n */\n\n", total);
+    fprintf(out, "// block sizes below CLASSLIMIT have their lists chosen "
+            "here\n#define CLASSSHIFT       %d\n#define CLASSLIMIT       "
+            "((size_t) 1 << CLASSSHIFT)\n", shift);
+    fprintf(out, "// first of the lists per power of two from CLASSLIMIT\n"
+            "#define CLASSLISTS       %d\n", k + 1);
+    fprintf(out, "// identifies these classes, for heaps kept in files\n"
+            "#define CLASSID          0x%016llxull\n\n",
+            (unsigned long long) id);
+    fprintf(out, "// list for each block size / 8\nstatic const uint8_t "
+            "class_table[CLASSLIMIT / 8 + 1] = {");
+    for (i = 0; i <= slots; i++)
+        fprintf(out, "%s%3u,", i % 12 == 0 ? "\n   " : "", table[i]);
+    fprintf(out, "\n};\n\n// smallest block size on each list\n"
+            "static const uint32_t class_floor[CLASSLISTS] = {\n    0,");
+    for (i = 0; i < (size_t) k; i++)
+        fprintf(out, "%s%llu,", (i + 1) % 10 == 0 ? "\n    " : " ",
+                (unsigned long long) (i == 0 ? MINBLOCK : cut[i] * 8));
+    fprintf(out, "\n};\n");
+    if (out != stdout && fclose(out) != 0) {
+        fprintf(stderr, "classgen: %s: %s\n", out_path, strerror(errno));
+        return 1;
+    }
+
+    for (i = 0, w = 0; i < (size_t) k; i++) {
+        b = i + 1 < (size_t) k ? cut[i + 1] : slots;
+        if (b - cut[i] == 1)
+            w += weight[cut[i]];
+    }
+    fprintf(stderr, "%d lists below %llu, %.1f%% of allocations on lists "
+            "of one size, %.1f%% likely to meet a smaller block first\n", k,
+            (unsigned long long) limit, 100 * w / total, 100 * missed);
+    return 0;
+}
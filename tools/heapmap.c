@@ -0,0 +1,149 @@
+/*
+ * heapmap - render a heap dump written by ma_heap_dump as a map of how
+ * full each page is, and summarize how much free memory sits on pages
+ * that can't be given back because something else on them is live.
+ *
+ * usage: heapmap [dump]    reads standard input if no file is given
+ *
+ * each character is one page: ' ' nothing live, '.' under a quarter, ':'
+ * under half, 'o' under three quarters, 'O' under all of it and '#' full.
+ * blocks on quick lists and in thread caches count as live, since they
+ * pin their pages like live ones do. runs of pages with no blocks at all
+ * start a new line.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "../microalloc.h"
+
+// pages per line of the map
+#define LINEPAGES 64
+
+typedef struct page {
+    uint64_t number;
+    uint64_t live;
+} Page;
+
+static const char *kinds[] = {"heap", "slab", "buddy", "large"};
+
+static int by_addr(const void *a, const void *b)
+{
+    const struct ma_dump_record *x = a, *y = b;
+
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+// map a page's live bytes to its character
+static char occupancy(uint64_t live, uint64_t page_size)
+{
+    if (live == 0)
+        return ' ';
+    if (live >= page_size)
+        return '#';
+    return ".:oO"[live * 4 / page_size];
+}
+
+int main(int argc, char **argv)
+{
+    struct ma_dump_header hdr;
+    struct ma_dump_record *recs;
+    uint64_t live[4] = {0}, free_bytes[4] = {0}, pinned = 0;
+    uint64_t i, start, end, first, last, n, column = 0;
+    uint64_t pages_used = 0, pages_partial = 0;
+    Page *pages = NULL;
+    size_t npages = 0, cap = 0, p;
+    FILE *in = stdin;
+    int live_block;
+
+    if (argc > 1 && (in = fopen(argv[1], "rb")) == NULL) {
+        fprintf(stderr, "heapmap: %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 || hdr.magic != MA_DUMP_MAGIC ||
+        hdr.page_size == 0 || (hdr.page_size & (hdr.page_size - 1)) != 0) {
+        fprintf(stderr, "heapmap: not a heap dump\n");
+        return 1;
+    }
+    if ((recs = malloc(hdr.count * sizeof(*recs) + 1)) == NULL ||
+        fread(recs, sizeof(*recs), hdr.count, in) != hdr.count) {
+        fprintf(stderr, "heapmap: truncated dump\n");
+        return 1;
+    }
+    qsort(recs, hdr.count, sizeof(*recs), by_addr);
+
+    // add each block's live bytes to the pages it covers
+    for (i = 0; i < hdr.count; i++) {
+        if (recs[i].kind > MA_KIND_LARGE || recs[i].size == 0)
+            continue;
+        live_block = recs[i].state == MA_ALLOCATED ||
+                     recs[i].state == MA_QUICK;
+        if (live_block)
+            live[recs[i].kind] += recs[i].size;
+        else
+            free_bytes[recs[i].kind] += recs[i].size;
+        first = recs[i].addr / hdr.page_size;
+        last = (recs[i].addr + recs[i].size - 1) / hdr.page_size;
+        for (n = first; n <= last; n++) {
+            if (npages == 0 || pages[npages - 1].number != n) {
+                if (npages == cap) {
+                    cap = cap == 0 ? 1024 : cap * 2;
+                    if ((pages = realloc(pages, cap * sizeof(*pages))) ==
+                        NULL) {
+                        fprintf(stderr, "heapmap: out of memory\n");
+                        return 1;
+                    }
+                }
+                pages[npages].number = n;
+                pages[npages++].live = 0;
+            }
+            if (!live_block)
+                continue;
+            start = n == first ? recs[i].addr : n * hdr.page_size;
+            end = n == last ? recs[i].addr + recs[i].size :
+                              (n + 1) * hdr.page_size;
+            pages[npages - 1].live += end - start;
+        }
+    }
+
+    for (p = 0; p < npages; p++) {
+        if (p == 0 || pages[p].number != pages[p - 1].number + 1) {
+            printf("%s%#llx\n", p == 0 ? "" : "\n",
+                   (unsigned long long) (pages[p].number * hdr.page_size));
+            column = 0;
+        } else if (column == LINEPAGES) {
+            putchar('\n');
+            column = 0;
+        }
+        putchar(occupancy(pages[p].live, hdr.page_size));
+        column++;
+        if (pages[p].live != 0) {
+            pages_used++;
+            if (pages[p].live < hdr.page_size) {
+                pages_partial++;
+                pinned += hdr.page_size - pages[p].live;
+            }
+        }
+    }
+    if (npages != 0)
+        putchar('\n');
+
+    printf("\n%llu blocks, page size %llu\n", (unsigned long long) hdr.count,
+           (unsigned long long) hdr.page_size);
+    for (i = 0; i < 4; i++) {
+        if (live[i] != 0 || free_bytes[i] != 0)
+            printf("%-6s %12llu live %12llu free\n", kinds[i],
+                   (unsigned long long) live[i],
+                   (unsigned long long) free_bytes[i]);
+    }
+    printf("%llu of %llu pages in use, %llu partly\n",
+           (unsigned long long) pages_used, (unsigned long long) npages,
+           (unsigned long long) pages_partial);
+    printf("%llu free bytes pinned on partly used pages\n",
+           (unsigned long long) pinned);
+    free(pages);
+    free(recs);
+    return 0;
+}
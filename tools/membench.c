@@ -0,0 +1,254 @@
+/*
+ * membench - measure how much memory an allocator holds on to, rather
+ * than how fast it is. a phased workload runs against whichever malloc
+ * the program ends up with - glibc's, or microalloc's under LD_PRELOAD -
+ * and every so many operations the resident set size is printed next to
+ * the bytes the workload has live and the bytes the allocator counts as
+ * allocated.
+ *
+ * usage: membench [-n ops] [-s samples] [-w wait_ms]
+ *
+ * the phases are:
+ *   ramp    allocate n / 4 objects and keep them
+ *   churn   n / 2 times, free a random object and allocate another
+ *   free    free nine in ten objects, chosen at random
+ *   regrow  allocate back up to n / 4 objects
+ * after the free phase, resident size is polled for up to wait_ms
+ * (default 1000) to see how long the freed memory takes to go back to the
+ * system - the maintenance thread gives it back late, and glibc may never.
+ *
+ * sizes are mostly under 128 bytes, with some up to 1k and a few up to
+ * 16k, and every object is written in full so that it's resident.
+ * `make bench` runs it against glibc and microalloc.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <malloc.h>
+#include <sys/mman.h>
+
+#include "../microalloc.h"
+
+// every object is counted under this tag when running on microalloc
+#define BENCHTAG         1
+
+typedef struct object {
+    void *ptr;
+    size_t size;
+} Object;
+
+static const char *phases[] = {"ramp", "churn", "free", "regrow"};
+
+// microalloc's extensions, if it's the allocator in use
+static void (*get_stats)(struct ma_stats *);
+static unsigned (*set_tag)(unsigned);
+
+static Object *objects;
+static size_t live_count, live_bytes, ops_done, sample_every;
+static long page;
+static uint64_t rng = 0x9E3779B97F4A7C15ull;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static size_t next_size(void)
+{
+    uint64_t r = next_random();
+
+    switch (r % 20) {
+    case 0:
+        return 1024 + (r >> 8) % (15 << 10);
+    case 1: case 2: case 3: case 4: case 5:
+        return 128 + (r >> 8) % 896;
+    default:
+        return 16 + (r >> 8) % 112;
+    }
+}
+
+// resident set size in bytes, read without allocating
+static size_t rss(void)
+{
+    char buf[128], *p;
+    ssize_t n;
+    int fd;
+
+    if ((fd = open("/proc/self/statm", O_RDONLY)) < 0)
+        return 0;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+    // the second field is resident pages
+    p = strchr(buf, ' ');
+    return p == NULL ? 0 : strtoull(p + 1, NULL, 10) * page;
+}
+
+/* bytes the allocator itself counts as allocated, and as taken from the
+ * system. glibc's counts come from mallinfo2. */
+static void allocator_counts(size_t *allocated, size_t *footprint)
+{
+    static struct ma_stats st;
+    struct mallinfo2 mi;
+
+    if (get_stats != NULL) {
+        get_stats(&st);
+        *allocated = st.tag_bytes[BENCHTAG];
+        *footprint = st.footprint;
+        return;
+    }
+    mi = mallinfo2();
+    *allocated = mi.uordblks + mi.hblkhd;
+    *footprint = mi.arena + mi.hblkhd;
+}
+
+static void sample(int phase)
+{
+    size_t resident = rss(), allocated, footprint;
+
+    allocator_counts(&allocated, &footprint);
+    printf("%-6s %10zu %10zu %10zu %10zu %10zu %7.2f\n", phases[phase],
+           ops_done, resident >> 10, live_bytes >> 10, allocated >> 10,
+           footprint >> 10,
+           live_bytes == 0 ? 0 : (double) resident / live_bytes);
+}
+
+// count an operation, sampling every sample_every of them
+static void tick(int phase)
+{
+    if (++ops_done % sample_every == 0)
+        sample(phase);
+}
+
+static void add_object(void)
+{
+    Object *o = &objects[live_count++];
+
+    o->size = next_size();
+    if ((o->ptr = malloc(o->size)) == NULL) {
+        perror("membench: malloc");
+        exit(1);
+    }
+    memset(o->ptr, 0xa5, o->size);
+    live_bytes += o->size;
+}
+
+static void remove_object(size_t i)
+{
+    free(objects[i].ptr);
+    live_bytes -= objects[i].size;
+    objects[i] = objects[--live_count];
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    size_t ops = 1 << 20, samples = 40, wait_ms = 1000, target, i;
+    size_t freed, before, after, now, half_at = 0;
+    double start;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:w:")) != -1) {
+        switch (opt) {
+        case 'n': ops = strtoull(optarg, NULL, 0); break;
+        case 's': samples = strtoull(optarg, NULL, 0); break;
+        case 'w': wait_ms = strtoull(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "usage: membench [-n ops] [-s samples] "
+                    "[-w wait_ms]\n");
+            return 1;
+        }
+    }
+    if (ops < 8 || samples == 0) {
+        fprintf(stderr, "membench: need at least 8 ops and 1 sample\n");
+        return 1;
+    }
+    page = sysconf(_SC_PAGESIZE);
+    target = ops / 4;
+    // the workload's own bookkeeping stays out of the allocator
+    objects = mmap(NULL, target * sizeof(Object), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (objects == MAP_FAILED) {
+        perror("membench: mmap");
+        return 1;
+    }
+    // roughly the total operations, over the number of samples wanted
+    sample_every = (target * 2 + ops / 2 + target * 9 / 10) / samples;
+    if (sample_every == 0)
+        sample_every = 1;
+
+    get_stats = (void (*)(struct ma_stats *)) dlsym(RTLD_DEFAULT,
+                                                    "ma_get_stats");
+    set_tag = (unsigned (*)(unsigned)) dlsym(RTLD_DEFAULT, "ma_set_tag");
+    if (get_stats != NULL && set_tag == NULL)
+        get_stats = NULL;
+    printf("allocator: %s, %zu ops, %zu kB resident at start\n",
+           get_stats != NULL ? "microalloc" : "glibc", ops, rss() >> 10);
+    printf("%-6s %10s %10s %10s %10s %10s %7s\n", "phase", "ops",
+           "rss_kb", "live_kb", "alloc_kb", "footpr_kb", "rss/live");
+    fflush(stdout);
+    if (set_tag != NULL)
+        set_tag(BENCHTAG);
+
+    while (live_count < target) {
+        add_object();
+        tick(0);
+    }
+    for (i = 0; i < ops / 2; i++) {
+        remove_object(next_random() % live_count);
+        add_object();
+        tick(1);
+    }
+    before = rss();
+    freed = live_bytes;
+    while (live_count > target / 10) {
+        remove_object(next_random() % live_count);
+        tick(2);
+    }
+    freed -= live_bytes;
+    sample(2);
+
+    // wait for the freed memory to leave the resident set
+    after = rss();
+    start = now_ms();
+    while (now_ms() - start < wait_ms) {
+        now = rss();
+        if (half_at == 0 && now + freed / 2 <= before)
+            half_at = now_ms() - start + 1;
+        if (now < after)
+            after = now;
+        usleep(1000);
+    }
+
+    while (live_count < target) {
+        add_object();
+        tick(3);
+    }
+    sample(3);
+
+    printf("freed %zu kB: %zu kB of it returned within %zu ms", freed >> 10,
+           before > after ? (before - after) >> 10 : 0, wait_ms);
+    if (half_at != 0)
+        printf(", half within %zu ms\n", half_at);
+    else
+        printf(", never half\n");
+    return 0;
+}
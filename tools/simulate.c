@@ -0,0 +1,307 @@
+/*
+ * simulate - replay an allocation trace against microalloc, linked into
+ * this program, over a grid of settings, and print throughput, peak
+ * footprint and fragmentation for each point as CSV.
+ *
+ * usage: simulate trace NAME=value,value... ...
+ *
+ * the trace has a call per line: "m id size" for malloc, "c id size" for
+ * calloc, "r id size" for realloc and "f id" for free, where id names the
+ * allocation - the address the traced program saw will do. lines starting
+ * with '#' are skipped.
+ *
+ * each NAME=values argument sets MICROALLOC_NAME, and every combination
+ * of the values is run, e.g.
+ *
+ *     simulate app.trace LARGE=4k,64k UNSORTED_CAP=16,1000 SPLIT_MIN=32,64
+ *                        ADDR_ORDER=0,1 GROW=0,2m TRIM=128k,1m
+ *
+ * the allocator reads its settings when it starts, so each point runs in
+ * a fresh copy of this program with the parsed trace passed along. peak
+ * live is the most bytes the trace had allocated at once, and
+ * fragmentation is how much of the peak footprint went beyond that.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "../microalloc.h"
+
+enum { OP_MALLOC, OP_CALLOC, OP_REALLOC, OP_FREE };
+
+// one call from the trace. slot numbers each allocation from 0.
+typedef struct op {
+    uint32_t kind;
+    uint32_t slot;
+    uint64_t size;
+} Op;
+
+// what the parsed trace file starts with
+typedef struct trace {
+    uint64_t ops;
+    uint64_t slots;
+} Trace;
+
+/* trace ids to the slot of their current allocation, plus one so that 0
+ * means the id has been freed. entries stay used once they've been filled
+ * so that probing for ids placed after them still works. */
+typedef struct id_slot {
+    uint64_t id;
+    uint32_t slot;
+    uint32_t used;
+} IdSlot;
+
+static IdSlot *ids;
+static size_t id_cap, id_count;
+
+static void die(const char *msg)
+{
+    fprintf(stderr, "simulate: %s: %s\n", msg, strerror(errno));
+    exit(1);
+}
+
+// find id's entry in the table, adding an empty one if it's not there
+static IdSlot *id_find(uint64_t id)
+{
+    IdSlot *old = ids;
+    size_t i, cap = id_cap;
+
+    if (id_count * 2 >= id_cap) {
+        id_cap = id_cap == 0 ? 1024 : id_cap * 2;
+        if ((ids = calloc(id_cap, sizeof(*ids))) == NULL)
+            die("out of memory");
+        id_count = 0;
+        for (i = 0; i < cap; i++) {
+            if (old[i].used && old[i].slot != 0)
+                id_find(old[i].id)->slot = old[i].slot;
+        }
+        free(old);
+    }
+    for (i = id * 0x9E3779B97F4A7C15ull >> 20; ; i++) {
+        i &= id_cap - 1;
+        if (!ids[i].used || ids[i].id == id)
+            break;
+    }
+    if (!ids[i].used) {
+        ids[i].id = id;
+        ids[i].used = 1;
+        id_count++;
+    }
+    return &ids[i];
+}
+
+/* parse the trace into an unlinked file of Ops that every run maps.
+ * frees of ids that were never allocated are dropped. */
+static int parse_trace(const char *path)
+{
+    char line[256], kind;
+    unsigned long long id, size;
+    Trace hdr = {0, 0};
+    IdSlot *entry;
+    Op op;
+    FILE *in, *out;
+    long n = 0;
+    int fields;
+
+    if ((in = fopen(path, "r")) == NULL)
+        die(path);
+    // the file outlives exec, so every run can map it
+    if ((out = tmpfile()) == NULL ||
+        fcntl(fileno(out), F_SETFD, 0) < 0)
+        die("couldn't create a temporary file");
+    fwrite(&hdr, sizeof(hdr), 1, out);
+    while (fgets(line, sizeof(line), in) != NULL) {
+        n++;
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+        size = 0;
+        fields = sscanf(line, " %c %llx %llu", &kind, &id, &size);
+        if (fields < 2 || (kind != 'f' && fields < 3) ||
+            strchr("mcrf", kind) == NULL) {
+            fprintf(stderr, "simulate: %s:%ld: bad line\n", path, n);
+            exit(1);
+        }
+        entry = id_find(id);
+        op.size = size;
+        if (kind == 'f' || (kind == 'r' && size == 0)) {
+            if (entry->slot == 0)
+                continue;
+            op.kind = OP_FREE;
+            op.slot = entry->slot - 1;
+            entry->slot = 0;
+        } else if (kind == 'r' && entry->slot != 0) {
+            op.kind = OP_REALLOC;
+            op.slot = entry->slot - 1;
+        } else {
+            // a new allocation, whatever its id held before
+            op.kind = kind == 'c' ? OP_CALLOC : OP_MALLOC;
+            op.slot = hdr.slots++;
+            entry->slot = op.slot + 1;
+        }
+        fwrite(&op, sizeof(op), 1, out);
+        hdr.ops++;
+    }
+    rewind(out);
+    fwrite(&hdr, sizeof(hdr), 1, out);
+    if (fflush(out) != 0)
+        die("couldn't write the parsed trace");
+    fclose(in);
+    return fileno(out);
+}
+
+// replay the trace in fd and print this point's results after values
+static int run(int fd, int nvalues, char **values)
+{
+    struct ma_stats st;
+    struct timespec start, end;
+    Trace *hdr;
+    const Op *op, *ops_end;
+    void **ptrs, *p;
+    uint64_t *sizes, live = 0, peak_live = 0;
+    double secs;
+    int i;
+
+    if ((hdr = mmap(NULL, sizeof(*hdr), PROT_READ, MAP_PRIVATE, fd, 0)) ==
+        MAP_FAILED)
+        die("couldn't map the parsed trace");
+    op = mmap(NULL, sizeof(*hdr) + hdr->ops * sizeof(Op), PROT_READ,
+              MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    ptrs = calloc(hdr->slots + 1, sizeof(void *));
+    sizes = calloc(hdr->slots + 1, sizeof(uint64_t));
+    if (op == MAP_FAILED || ptrs == NULL || sizes == NULL)
+        die("couldn't set up the replay");
+    op = (const Op *) ((const char *) op + sizeof(*hdr));
+    ops_end = op + hdr->ops;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (; op < ops_end; op++) {
+        switch (op->kind) {
+        case OP_MALLOC:
+            ptrs[op->slot] = ma_malloc(op->size);
+            break;
+        case OP_CALLOC:
+            ptrs[op->slot] = ma_calloc(1, op->size);
+            break;
+        case OP_REALLOC:
+            if ((p = ma_realloc(ptrs[op->slot], op->size)) == NULL)
+                continue;
+            ptrs[op->slot] = p;
+            break;
+        case OP_FREE:
+            ma_free(ptrs[op->slot]);
+            ptrs[op->slot] = NULL;
+            live -= sizes[op->slot];
+            continue;
+        }
+        if (ptrs[op->slot] == NULL)
+            continue;
+        live += op->size - sizes[op->slot];
+        sizes[op->slot] = op->size;
+        if (live > peak_live)
+            peak_live = live;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    secs = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    ma_get_stats(&st);
+    for (i = 0; i < nvalues; i++)
+        printf("%s,", values[i]);
+    printf("%.0f,%zu,%llu,%.4f,%zu\n", hdr->ops / secs, st.footprint_peak,
+           (unsigned long long) peak_live, st.footprint_peak == 0 ? 0 :
+           1 - (double) peak_live / st.footprint_peak, st.footprint);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    char **names, ***values, **point, *eq, *tok, *save, *env, fdarg[16];
+    size_t *counts, *at;
+    int fd, n, i, status;
+    pid_t pid;
+
+    // a single point, started by the loop below
+    if (argc >= 3 && strcmp(argv[1], "-x") == 0)
+        return run(atoi(argv[2]), argc - 3, argv + 3);
+    if (argc < 2) {
+        fprintf(stderr, "usage: simulate trace NAME=value,value... ...\n");
+        return 1;
+    }
+
+    n = argc - 2;
+    names = calloc(n, sizeof(char *));
+    values = calloc(n, sizeof(char **));
+    counts = calloc(n, sizeof(size_t));
+    at = calloc(n, sizeof(size_t));
+    point = calloc(n + 4, sizeof(char *));
+    if (names == NULL || values == NULL || counts == NULL || at == NULL ||
+        point == NULL)
+        die("out of memory");
+    for (i = 0; i < n; i++) {
+        if ((eq = strchr(argv[i + 2], '=')) == NULL || eq == argv[i + 2]) {
+            fprintf(stderr, "simulate: expected NAME=values, not %s\n",
+                    argv[i + 2]);
+            return 1;
+        }
+        *eq = '\0';
+        names[i] = argv[i + 2];
+        for (tok = strtok_r(eq + 1, ",", &save); tok != NULL;
+             tok = strtok_r(NULL, ",", &save)) {
+            values[i] = realloc(values[i], (counts[i] + 1) * sizeof(char *));
+            if (values[i] == NULL)
+                die("out of memory");
+            values[i][counts[i]++] = tok;
+        }
+        if (counts[i] == 0) {
+            fprintf(stderr, "simulate: no values for %s\n", names[i]);
+            return 1;
+        }
+    }
+
+    fd = parse_trace(argv[1]);
+    snprintf(fdarg, sizeof(fdarg), "%d", fd);
+    for (i = 0; i < n; i++)
+        printf("%s,", names[i]);
+    printf("ops_per_sec,peak_footprint,peak_live,fragmentation,"
+           "end_footprint\n");
+    fflush(stdout);
+
+    // count through every combination, the last name changing fastest
+    for (;;) {
+        if ((pid = fork()) < 0)
+            die("fork");
+        if (pid == 0) {
+            for (i = 0; i < n; i++) {
+                if (asprintf(&env, "MICROALLOC_%s", names[i]) < 0)
+                    die("out of memory");
+                setenv(env, values[i][at[i]], 1);
+                point[i + 3] = values[i][at[i]];
+            }
+            point[0] = argv[0];
+            point[1] = "-x";
+            point[2] = fdarg;
+            execv("/proc/self/exe", point);
+            die("couldn't run a point");
+        }
+        if (waitpid(pid, &status, 0) < 0)
+            die("waitpid");
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "simulate: point");
+            for (i = 0; i < n; i++)
+                fprintf(stderr, " %s=%s", names[i], values[i][at[i]]);
+            fprintf(stderr, " failed\n");
+        }
+        for (i = n - 1; i >= 0 && ++at[i] == counts[i]; i--)
+            at[i] = 0;
+        if (i < 0)
+            break;
+    }
+    return 0;
+}